@@ -0,0 +1,182 @@
+#include "analyzer.hpp"
+
+namespace {
+	struct Scope {
+		std::vector<Symbol*> symbols;
+		std::vector<BindingKind> kinds;
+		Scope* parent;
+		bool isLambda;
+
+		// Declares a binding; names of global variables are bound
+		// dynamically and stay out of the lexical scope.
+		void bind(Symbol* symbol) {
+			symbols.push_back(symbol);
+			kinds.push_back(Env::isSpecialVariable(symbol) ? BindingKind::Special : BindingKind::Local);
+		}
+
+		// Finds the lexical binding of `symbol`, marking it captured when
+		// the reference comes from inside a nested lambda.
+		bool resolve(Symbol* symbol) {
+			bool crossed = false;
+			for (Scope* scope = this; scope != nullptr; scope = scope->parent) {
+				for (size_t i = scope->symbols.size(); i-- > 0;) {
+					if (scope->symbols[i] != symbol)
+						continue;
+					if (scope->kinds[i] == BindingKind::Special)
+						return false;
+					if (crossed)
+						scope->kinds[i] = BindingKind::Captured;
+					return true;
+				}
+				crossed = crossed || scope->isLambda;
+			}
+			return false;
+		}
+	};
+
+	Node* analyzeForm(const LObj& objPtr, Scope* scope);
+
+	Node* analyzeBody(LObj forms, Scope* scope) {
+		std::vector<Node*> body;
+		while (forms.typep<Cons>()) {
+			body.push_back(analyzeForm(forms.getAs<Cons>().car, scope));
+			forms = forms.getAs<Cons>().cdr;
+		}
+		return gcNew<Seq>(std::move(body));
+	}
+
+	Node* analyzeLet(const LObj& objPtr, Scope* scope, bool sequential,
+		const char* wrongBindings, const char* oddBindings) {
+		LObj bindings = listNth(objPtr, 1);
+		if (!isProperList(bindings))
+			throw wrongBindings;
+		if (listLength(bindings) % 2 != 0)
+			throw oddBindings;
+		Scope inner{ {}, {}, scope, false };
+		std::vector<Node*> inits;
+		while (!bindings.isnull()) {
+			LObj objSymbol = bindings.getAs<Cons>().car;
+			LObj objForm = bindings.getAs<Cons>().cdr.getAs<Cons>().car;
+			if (!objSymbol.typep<Symbol>())
+				throw wrongBindings;
+			inits.push_back(analyzeForm(objForm, sequential ? &inner : scope));
+			inner.bind(&objSymbol.getAs<Symbol>());
+			bindings = listNthCdr(bindings, 2);
+		}
+		Node* body = analyzeBody(listNthCdr(objPtr, 2), &inner);
+		return gcNew<Let>(inner.symbols, inner.kinds, std::move(inits), body, sequential);
+	}
+
+	Node* analyzeLambda(const LObj& objPtr, Scope* scope, bool isMacro) {
+		Scope inner{ {}, {}, scope, true };
+		Symbol* rest = nullptr;
+		LObj pl = listNth(objPtr, 1);
+		while (pl.typep<Cons>()) {
+			if (!pl.getAs<Cons>().car.typep<Symbol>())
+				throw "Wrong usage";
+			inner.bind(&pl.getAs<Cons>().car.getAs<Symbol>());
+			pl = pl.getAs<Cons>().cdr;
+		}
+		std::vector<Symbol*> parameters = inner.symbols;
+		if (pl.typep<Symbol>() && !pl.isnull()) {
+			rest = &pl.getAs<Symbol>();
+			inner.bind(rest);
+		}
+		Node* body = analyzeBody(listNthCdr(objPtr, 2), &inner);
+		return gcNew<Lambda>(std::move(parameters), rest, inner.kinds, body, isMacro);
+	}
+
+	Node* analyzeSpecialForm(const LObj& objPtr, Scope* scope) {
+		const Symbol* operand = &objPtr.getAs<Cons>().car.getAs<Symbol>();
+		int length = listLength(objPtr);
+		if (operand == &Symbols::If) {
+			if (length == 3 || length == 4) {
+				Node* cond = analyzeForm(listNth(objPtr, 1), scope);
+				Node* then = analyzeForm(listNth(objPtr, 2), scope);
+				Node* otherwise = length == 4 ? analyzeForm(listNth(objPtr, 3), scope) : nullptr;
+				return gcNew<If>(cond, then, otherwise);
+			}
+		}
+		else if (operand == &Symbols::Quote) {
+			if (length == 2)
+				return gcNew<Const>(listNth(objPtr, 1));
+		}
+		else if (operand == &Symbols::Do) {
+			return analyzeBody(objPtr.getAs<Cons>().cdr, scope);
+		}
+		else if (operand == &Symbols::Define) {
+			if (length == 3) {
+				LObj variable = listNth(objPtr, 1);
+				if (!variable.typep<Symbol>())
+					throw "Wrong 'define'";
+				return gcNew<Define>(&variable.getAs<Symbol>(), analyzeForm(listNth(objPtr, 2), scope));
+			}
+		}
+		else if (operand == &Symbols::Set) {
+			if (length == 3) {
+				LObj variable = listNth(objPtr, 1);
+				if (!variable.typep<Symbol>())
+					throw "Wrong 'set!'";
+				Symbol* symbol = &variable.getAs<Symbol>();
+				bool local = scope != nullptr && scope->resolve(symbol);
+				return gcNew<Set>(symbol, analyzeForm(listNth(objPtr, 2), scope), local);
+			}
+		}
+		else if (operand == &Symbols::Let) {
+			if (length < 2) throw "Wrong usage";
+			return analyzeLet(objPtr, scope, false, "Wrong let bindings", "Odd number of let bindings");
+		}
+		else if (operand == &Symbols::LetStar) {
+			if (length < 2) throw "Wrong 'let*'";
+			return analyzeLet(objPtr, scope, true, "bad let* bindings", "number of bindings elements of let* is odd");
+		}
+		else if (operand == &Symbols::Lambda) {
+			if (2 <= length)
+				return analyzeLambda(objPtr, scope, false);
+		}
+		else if (operand == &Symbols::Macro) {
+			if (2 <= length)
+				return analyzeLambda(objPtr, scope, true);
+		}
+		else if (operand == &Symbols::Future) {
+			// A call of the global `future` with the form as a thunk.
+			if (length == 2) {
+				Scope inner{ {}, {}, scope, true };
+				Node* body = analyzeForm(listNth(objPtr, 1), &inner);
+				Node* thunk = gcNew<Lambda>(std::vector<Symbol*>{}, nullptr, inner.kinds, body, false);
+				return gcNew<Call>(gcNew<GlobalRef>(&Symbols::Future), std::vector<Node*>{ thunk });
+			}
+		}
+		return nullptr;
+	}
+
+	Node* analyzeForm(const LObj& objPtr, Scope* scope) {
+		if (objPtr.typep<Symbol>()) {
+			Symbol* symbol = &objPtr.getAs<Symbol>();
+			if (scope != nullptr && scope->resolve(symbol))
+				return gcNew<LocalRef>(symbol);
+			return gcNew<GlobalRef>(symbol);
+		}
+		if (!objPtr.typep<Cons>())
+			return gcNew<Const>(objPtr);
+
+		Cons* cons = &objPtr.getAs<Cons>();
+		if (cons->car.typep<Symbol>()) {
+			Node* special = analyzeSpecialForm(objPtr, scope);
+			if (special != nullptr)
+				return special;
+		}
+		if (!isProperList(cons->cdr))
+			throw "Wrong usage";
+		Node* function = analyzeForm(cons->car, scope);
+		std::vector<Node*> args;
+		for (LObj a = cons->cdr; a.typep<Cons>(); a = a.getAs<Cons>().cdr)
+			args.push_back(analyzeForm(a.getAs<Cons>().car, scope));
+		return gcNew<Call>(function, std::move(args));
+	}
+}
+
+Node* analyze(const LObj& objPtr) {
+	gc::DeferScope defer;
+	return analyzeForm(objPtr, nullptr);
+}
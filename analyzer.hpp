@@ -0,0 +1,179 @@
+#pragma once
+#include "lisp.hpp"
+
+// Macro-expanded forms are analyzed once into a tree of nodes, which the
+// compiler in vm.cpp turns into bytecode.
+class Node : public Base_Object {
+public:
+	explicit Node(Type t)
+		: Base_Object(t) {}
+
+	std::ostream& operator<<(std::ostream& os) const override {
+		os << "<Node>";
+		return os;
+	}
+};
+
+// How a variable introduced by let, let* or lambda is stored: in a VM stack
+// slot, in a heap Env because an inner lambda captures it, or as a dynamic
+// binding because the symbol names a global (special) variable.
+enum class BindingKind : uint8_t {
+	Local,
+	Captured,
+	Special
+};
+
+class Const : public Node {
+public:
+	static constexpr Type TypeTag = Type::Const;
+	LObj value;
+
+	Const(LObj v)
+		: Node(TypeTag), value(v) {}
+
+	void trace() const override {
+		gc::mark(value);
+	}
+};
+
+class LocalRef : public Node {
+public:
+	static constexpr Type TypeTag = Type::LocalRef;
+	Symbol* symbol;
+
+	LocalRef(Symbol* s)
+		: Node(TypeTag), symbol(s) {}
+
+	void trace() const override {
+		gc::mark(symbol);
+	}
+};
+
+class GlobalRef : public Node {
+public:
+	static constexpr Type TypeTag = Type::GlobalRef;
+	Symbol* symbol;
+
+	GlobalRef(Symbol* s)
+		: Node(TypeTag), symbol(s) {}
+
+	void trace() const override {
+		gc::mark(symbol);
+	}
+};
+
+class If : public Node {
+public:
+	static constexpr Type TypeTag = Type::If;
+	Node* cond;
+	Node* then;
+	Node* otherwise;
+
+	If(Node* c, Node* t, Node* o)
+		: Node(TypeTag), cond(c), then(t), otherwise(o) {}
+
+	void trace() const override {
+		gc::mark(cond);
+		gc::mark(then);
+		gc::mark(otherwise);
+	}
+};
+
+class Seq : public Node {
+public:
+	static constexpr Type TypeTag = Type::Seq;
+	std::vector<Node*> body;
+
+	Seq(std::vector<Node*> b)
+		: Node(TypeTag), body(std::move(b)) {}
+
+	void trace() const override {
+		for (Node* n : body) gc::mark(n);
+	}
+};
+
+class Define : public Node {
+public:
+	static constexpr Type TypeTag = Type::Define;
+	Symbol* symbol;
+	Node* value;
+
+	Define(Symbol* s, Node* v)
+		: Node(TypeTag), symbol(s), value(v) {}
+
+	void trace() const override {
+		gc::mark(symbol);
+		gc::mark(value);
+	}
+};
+
+class Set : public Node {
+public:
+	static constexpr Type TypeTag = Type::Set;
+	Symbol* symbol;
+	Node* value;
+	bool local;
+
+	Set(Symbol* s, Node* v, bool l)
+		: Node(TypeTag), symbol(s), value(v), local(l) {}
+
+	void trace() const override {
+		gc::mark(symbol);
+		gc::mark(value);
+	}
+};
+
+class Let : public Node {
+public:
+	static constexpr Type TypeTag = Type::Let;
+	std::vector<Symbol*> symbols;
+	std::vector<BindingKind> kinds;
+	std::vector<Node*> inits;
+	Node* body;
+	bool sequential;
+
+	Let(std::vector<Symbol*> s, std::vector<BindingKind> k, std::vector<Node*> i, Node* b, bool seq)
+		: Node(TypeTag), symbols(std::move(s)), kinds(std::move(k)), inits(std::move(i)), body(b), sequential(seq) {}
+
+	void trace() const override {
+		for (Symbol* s : symbols) gc::mark(s);
+		for (Node* n : inits) gc::mark(n);
+		gc::mark(body);
+	}
+};
+
+class Lambda : public Node {
+public:
+	static constexpr Type TypeTag = Type::Lambda;
+	std::vector<Symbol*> parameters;
+	Symbol* rest;
+	std::vector<BindingKind> kinds;
+	Node* body;
+	bool isMacro;
+
+	Lambda(std::vector<Symbol*> p, Symbol* r, std::vector<BindingKind> k, Node* b, bool m)
+		: Node(TypeTag), parameters(std::move(p)), rest(r), kinds(std::move(k)), body(b), isMacro(m) {}
+
+	void trace() const override {
+		for (Symbol* s : parameters) gc::mark(s);
+		gc::mark(rest);
+		gc::mark(body);
+	}
+};
+
+class Call : public Node {
+public:
+	static constexpr Type TypeTag = Type::Call;
+	Node* function;
+	std::vector<Node*> args;
+
+	Call(Node* f, std::vector<Node*> a)
+		: Node(TypeTag), function(f), args(std::move(a)) {}
+
+	void trace() const override {
+		gc::mark(function);
+		for (Node* n : args) gc::mark(n);
+	}
+};
+
+Node* analyze(const LObj& objPtr);
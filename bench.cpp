@@ -0,0 +1,218 @@
+#include "image.hpp"
+#include "interpreter.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iomanip>
+
+// Runs a fixed corpus of Lisp workloads and reports per-repetition timings
+// together with the collector's counters, as a table or as JSON for
+// comparing a build against a saved baseline.
+namespace {
+	struct Benchmark {
+		std::string name;
+		// Evaluated once, untimed.
+		std::string setup;
+		// Evaluated for every warmup and timed repetition.
+		std::string run;
+	};
+
+	struct Result {
+		std::string name;
+		uint64_t minNs;
+		uint64_t medianNs;
+		uint64_t meanNs;
+		size_t allocations;
+		size_t bytesAllocated;
+		size_t collections;
+		size_t peakHeapBytes;
+	};
+
+	const char* const Prelude = R"(
+(define list (lambda l l))
+)";
+
+	std::vector<Benchmark> corpus(const std::string& loadPath, const std::string& compiledLoadPath) {
+		return {
+			{ "fib",
+				"(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))",
+				"(fib 25)" },
+			{ "tak",
+				"(define tak (lambda (x y z) (if (< y x) (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y)) z)))",
+				"(tak 18 12 6)" },
+			{ "ackermann",
+				"(define ack (lambda (m n) (if (= m 0) (+ n 1) (if (= n 0) (ack (- m 1) 1) (ack (- m 1) (ack m (- n 1)))))))",
+				"(ack 3 6)" },
+			{ "nqueens",
+				"(define safe? (lambda (row dist placed) (if placed (if (= (car placed) (+ row dist)) null"
+				" (if (= (car placed) (- row dist)) null (if (= (car placed) row) null (safe? row (+ dist 1) (cdr placed))))) t)))"
+				"(define place (lambda (n k placed) (if (= k n) 1 (place-rows n k 0 placed))))"
+				"(define place-rows (lambda (n k row placed) (if (= row n) 0"
+				" (+ (if (safe? row 1 placed) (place n (+ k 1) (cons row placed)) 0) (place-rows n k (+ row 1) placed)))))",
+				"(place 8 0 null)" },
+			{ "deep-recursion",
+				"(define count-down (lambda (n) (if (= n 0) 0 (+ 1 (count-down (- n 1))))))",
+				"(count-down 100000)" },
+			{ "list-reverse",
+				"(define build (lambda (n acc) (if (= n 0) acc (build (- n 1) (cons n acc)))))"
+				"(define rev (lambda (l acc) (if l (rev (cdr l) (cons (car l) acc)) acc)))",
+				"(rev (build 100000 null) null)" },
+			{ "macro-expand",
+				"(define my-if (macro (c a b) (list (quote if) c a b)))"
+				"(define unless (macro (c . body) (list (quote if) c null (cons (quote do) body))))"
+				"(define form (quote (my-if (< 1 2) (unless (< 2 1) (my-if t (+ 1 2) 0) (my-if t 3 4)) 5)))"
+				"(define expand-loop (lambda (i acc) (if (= i 0) acc (expand-loop (- i 1) (+ acc (eval form))))))",
+				"(expand-loop 2000 0)" },
+			{ "string-print",
+				"(define datum (quote (a \"b\" 12345 (2.5 3) #(4 5) (nested (list (of symbols))))))"
+				"(define print-loop (lambda (i) (if (= i 0) 0 (do (print-to-string datum) (print-loop (- i 1))))))",
+				"(print-loop 5000)" },
+			{ "load",
+				"",
+				"(load \"" + loadPath + "\")" },
+			{ "load-compiled",
+				"(compile-file \"" + compiledLoadPath + "\")",
+				"(load \"" + compiledLoadPath + "\")" },
+		};
+	}
+
+	// A source file of many small definitions and calls, so `load` spends
+	// its time reading and compiling rather than running.
+	void writeLoadFile(const std::string& path) {
+		std::ofstream out(path);
+		for (int i = 0; i < 2000; ++i) {
+			out << "(define load-fn" << i << " (lambda (x y) (if (< x y) (+ x " << i << ") (cons y (quote (a b c))))))\n";
+			out << "(load-fn" << i << " " << i << " 1000)\n";
+		}
+		if (!out)
+			throw "Cannot write benchmark load file";
+	}
+
+	// Every benchmark runs in an interpreter of its own, so the peak of its
+	// heap is the benchmark's own and not the highest seen by any before it.
+	Result measure(const Benchmark& benchmark, int warmup, int repetitions) {
+		Interpreter interpreter;
+		Interpreter::Scope scope(interpreter);
+		interpreter.evaluate(Prelude);
+		interpreter.evaluate(benchmark.setup);
+		for (int i = 0; i < warmup; ++i)
+			interpreter.evaluate(benchmark.run);
+
+		std::vector<uint64_t> times;
+		size_t allocations = gc::allocations();
+		size_t bytes = gc::bytesAllocated();
+		size_t collections = gc::collections();
+		for (int i = 0; i < repetitions; ++i) {
+			auto start = std::chrono::steady_clock::now();
+			interpreter.evaluate(benchmark.run);
+			auto stop = std::chrono::steady_clock::now();
+			times.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(stop - start).count());
+		}
+		std::sort(times.begin(), times.end());
+		uint64_t total = 0;
+		for (uint64_t t : times)
+			total += t;
+		return {
+			benchmark.name,
+			times.front(),
+			times[times.size() / 2],
+			total / times.size(),
+			(gc::allocations() - allocations) / repetitions,
+			(gc::bytesAllocated() - bytes) / repetitions,
+			gc::collections() - collections,
+			gc::peakHeapSize(),
+		};
+	}
+
+	void printTable(const std::vector<Result>& results) {
+		std::cout << std::left << std::setw(16) << "benchmark" << std::right
+			<< std::setw(14) << "min ns" << std::setw(14) << "median ns" << std::setw(14) << "mean ns"
+			<< std::setw(12) << "allocs" << std::setw(14) << "bytes" << std::setw(6) << "gcs"
+			<< std::setw(16) << "peak heap bytes" << '\n';
+		for (const Result& r : results) {
+			std::cout << std::left << std::setw(16) << r.name << std::right
+				<< std::setw(14) << r.minNs << std::setw(14) << r.medianNs << std::setw(14) << r.meanNs
+				<< std::setw(12) << r.allocations << std::setw(14) << r.bytesAllocated << std::setw(6) << r.collections
+				<< std::setw(16) << r.peakHeapBytes << '\n';
+		}
+	}
+
+	void printJson(const std::vector<Result>& results, int warmup, int repetitions) {
+		std::cout << "{\n  \"warmup\": " << warmup << ",\n  \"repetitions\": " << repetitions << ",\n  \"benchmarks\": [";
+		for (size_t i = 0; i < results.size(); ++i) {
+			const Result& r = results[i];
+			std::cout << (i == 0 ? "\n" : ",\n")
+				<< "    { \"name\": \"" << r.name << "\""
+				<< ", \"min_ns\": " << r.minNs
+				<< ", \"median_ns\": " << r.medianNs
+				<< ", \"mean_ns\": " << r.meanNs
+				<< ", \"allocations\": " << r.allocations
+				<< ", \"bytes_allocated\": " << r.bytesAllocated
+				<< ", \"collections\": " << r.collections
+				<< ", \"peak_heap_bytes\": " << r.peakHeapBytes << " }";
+		}
+		std::cout << "\n  ]\n}\n";
+	}
+
+	void usage(const char* program) {
+		std::cerr << "usage: " << program << " [--json] [--warmup N] [--repetitions N] [benchmark...]\n";
+	}
+}
+
+int main(int argc, char* argv[]) {
+	bool json = false;
+	int warmup = 2;
+	int repetitions = 10;
+	std::vector<std::string> selected;
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--json") == 0) {
+			json = true;
+		}
+		else if (std::strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+			warmup = std::max(0, std::atoi(argv[++i]));
+		}
+		else if (std::strcmp(argv[i], "--repetitions") == 0 && i + 1 < argc) {
+			repetitions = std::max(1, std::atoi(argv[++i]));
+		}
+		else if (argv[i][0] == '-') {
+			usage(argv[0]);
+			return 2;
+		}
+		else {
+			selected.push_back(argv[i]);
+		}
+	}
+
+	std::string loadPath = (std::filesystem::temp_directory_path() / "lisp-bench-load.lisp").string();
+	std::string compiledLoadPath = (std::filesystem::temp_directory_path() / "lisp-bench-load-compiled.lisp").string();
+	auto removeLoadFiles = [&] {
+		std::remove(loadPath.c_str());
+		std::remove(compiledLoadPath.c_str());
+		std::remove(compiledPath(compiledLoadPath).c_str());
+	};
+	std::vector<Result> results;
+	try {
+		writeLoadFile(loadPath);
+		writeLoadFile(compiledLoadPath);
+		for (const Benchmark& benchmark : corpus(loadPath, compiledLoadPath)) {
+			if (!selected.empty() && std::find(selected.begin(), selected.end(), benchmark.name) == selected.end())
+				continue;
+			results.push_back(measure(benchmark, warmup, repetitions));
+		}
+	}
+	catch (char const* e) {
+		std::cerr << "Exception error: " << e << std::endl;
+		removeLoadFiles();
+		return 1;
+	}
+	removeLoadFiles();
+
+	if (json)
+		printJson(results, warmup, repetitions);
+	else
+		printTable(results);
+	return 0;
+}
@@ -0,0 +1,466 @@
+#include "gc.hpp"
+#include "lisp.hpp"
+#include <atomic>
+#include <cassert>
+#include <csetjmp>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_set>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#if defined(_MSC_VER)
+#define GC_NOINLINE __declspec(noinline)
+#else
+#define GC_NOINLINE __attribute__((noinline))
+#endif
+
+namespace {
+	constexpr size_t BlockSize = 256 * 1024;
+	constexpr size_t Granule = 16;
+	constexpr size_t LargeObjectSize = 1024;
+	constexpr size_t InitialThreshold = 4 * 1024 * 1024;
+	constexpr size_t SizeClassSizes[] = { 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024 };
+	constexpr size_t SizeClassCount = sizeof(SizeClassSizes) / sizeof(SizeClassSizes[0]);
+
+	struct FreeCell {
+		FreeCell* next;
+	};
+
+	// A block is a BlockSize-aligned region: this header followed by
+	// equally sized cells that are handed out by bumping `bump`.
+	struct Block {
+		size_t cellSize;
+		size_t cellCount;
+		size_t bump;
+		size_t sizeClass;
+		uint64_t live[BlockSize / Granule / 64];
+
+		char* cells() {
+			return reinterpret_cast<char*>(this) + HeaderSize();
+		}
+
+		static constexpr size_t HeaderSize() {
+			return (sizeof(Block) + Granule - 1) / Granule * Granule;
+		}
+
+		bool isLive(size_t i) const {
+			return live[i / 64] & (uint64_t(1) << (i % 64));
+		}
+		void setLive(size_t i, bool b) {
+			if (b)
+				live[i / 64] |= uint64_t(1) << (i % 64);
+			else
+				live[i / 64] &= ~(uint64_t(1) << (i % 64));
+		}
+	};
+
+	struct SizeClass {
+		size_t cellSize = 0;
+		FreeCell* freeList = nullptr;
+		Block* bumpBlock = nullptr;
+		std::vector<Block*> blocks;
+	};
+}
+
+struct gc::Heap {
+	Heap* const parent;
+	SizeClass classes[SizeClassCount];
+	uint8_t classIndex[LargeObjectSize / Granule + 1];
+	std::unordered_set<uintptr_t> blockSet;
+	std::map<uintptr_t, size_t> largeObjects;
+	uintptr_t lowAddress = UINTPTR_MAX;
+	uintptr_t highAddress = 0;
+	std::vector<Base_Object*> markStack;
+	std::vector<std::vector<LObj>*> vectorRoots;
+	size_t allocatedSinceCollect = 0;
+	size_t liveBytes = 0;
+	size_t threshold = InitialThreshold;
+	size_t collections = 0;
+	size_t allocations = 0;
+	size_t bytesAllocated = 0;
+	size_t peakSize = 0;
+	gc::TypeCounts typeCounts[static_cast<size_t>(Type::Count)];
+	int deferDepth = 0;
+	bool collecting = false;
+	std::atomic<int> sharers = 0;
+
+	explicit Heap(Heap* p)
+		: parent(p) {
+		size_t c = 0;
+		for (size_t g = 0; g <= LargeObjectSize / Granule; ++g) {
+			while (SizeClassSizes[c] < g * Granule) ++c;
+			classIndex[g] = static_cast<uint8_t>(c);
+		}
+		for (size_t i = 0; i < SizeClassCount; ++i)
+			classes[i].cellSize = SizeClassSizes[i];
+	}
+};
+
+namespace {
+	thread_local gc::Heap* heap = nullptr;
+
+	void noteRange(uintptr_t lo, uintptr_t hi) {
+		if (lo < heap->lowAddress) heap->lowAddress = lo;
+		if (hi > heap->highAddress) heap->highAddress = hi;
+	}
+
+	void* alignedAlloc(size_t size) {
+#if defined(_WIN32)
+		void* p = _aligned_malloc(size, BlockSize);
+#else
+		void* p = std::aligned_alloc(BlockSize, size);
+#endif
+		if (p == nullptr) throw std::bad_alloc();
+		return p;
+	}
+
+	void alignedFree(void* p) {
+#if defined(_WIN32)
+		_aligned_free(p);
+#else
+		std::free(p);
+#endif
+	}
+
+	Block* newBlock(size_t sizeClass) {
+		Block* block = static_cast<Block*>(alignedAlloc(BlockSize));
+		block->cellSize = heap->classes[sizeClass].cellSize;
+		block->cellCount = (BlockSize - Block::HeaderSize()) / block->cellSize;
+		block->bump = 0;
+		block->sizeClass = sizeClass;
+		std::memset(block->live, 0, sizeof(block->live));
+		heap->classes[sizeClass].blocks.push_back(block);
+		uintptr_t base = reinterpret_cast<uintptr_t>(block);
+		heap->blockSet.insert(base);
+		noteRange(base, base + BlockSize);
+		return block;
+	}
+
+	void freeBlock(Block* block) {
+		heap->blockSet.erase(reinterpret_cast<uintptr_t>(block));
+		alignedFree(block);
+	}
+
+	Block* blockOf(const void* cell) {
+		return reinterpret_cast<Block*>(reinterpret_cast<uintptr_t>(cell) & ~(BlockSize - 1));
+	}
+
+	void* allocateSmall(size_t size) {
+		SizeClass& sc = heap->classes[heap->classIndex[(size + Granule - 1) / Granule]];
+		char* cell;
+		if (sc.freeList != nullptr) {
+			cell = reinterpret_cast<char*>(sc.freeList);
+			sc.freeList = sc.freeList->next;
+		}
+		else {
+			if (sc.bumpBlock == nullptr || sc.bumpBlock->bump == sc.bumpBlock->cellCount)
+				sc.bumpBlock = newBlock(&sc - heap->classes);
+			cell = sc.bumpBlock->cells() + sc.bumpBlock->bump++ * sc.cellSize;
+		}
+		Block* block = blockOf(cell);
+		block->setLive((cell - block->cells()) / block->cellSize, true);
+		return cell;
+	}
+
+	void* allocateLarge(size_t size) {
+		void* p = ::operator new(size);
+		uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+		heap->largeObjects[addr] = size;
+		noteRange(addr, addr + size);
+		return p;
+	}
+
+	void markAmbiguous(uintptr_t word) {
+		if (word < heap->lowAddress || word >= heap->highAddress)
+			return;
+		uintptr_t base = word & ~(BlockSize - 1);
+		if (heap->blockSet.count(base)) {
+			Block* block = reinterpret_cast<Block*>(base);
+			uintptr_t cells = reinterpret_cast<uintptr_t>(block->cells());
+			if (word < cells) return;
+			size_t i = (word - cells) / block->cellSize;
+			if (i < block->bump && block->isLive(i))
+				gc::mark(reinterpret_cast<Base_Object*>(cells + i * block->cellSize));
+			return;
+		}
+		auto it = heap->largeObjects.upper_bound(word);
+		if (it == heap->largeObjects.begin()) return;
+		--it;
+		if (word < it->first + it->second)
+			gc::mark(reinterpret_cast<Base_Object*>(it->first));
+	}
+
+	void scanRange(const void* lo, const void* hi) {
+		uintptr_t p = (reinterpret_cast<uintptr_t>(lo) + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+		uintptr_t end = reinterpret_cast<uintptr_t>(hi);
+		for (; p + sizeof(uintptr_t) <= end; p += sizeof(uintptr_t)) {
+			uintptr_t word;
+			std::memcpy(&word, reinterpret_cast<const void*>(p), sizeof(word));
+			markAmbiguous(word);
+		}
+	}
+
+	const void* stackTop() {
+		thread_local const void* top = nullptr;
+		if (top != nullptr) return top;
+#if defined(_WIN32)
+		ULONG_PTR low, high;
+		GetCurrentThreadStackLimits(&low, &high);
+		top = reinterpret_cast<const void*>(high);
+#elif defined(__APPLE__)
+		top = pthread_get_stackaddr_np(pthread_self());
+#else
+		pthread_attr_t attr;
+		void* addr;
+		size_t size;
+		pthread_getattr_np(pthread_self(), &attr);
+		pthread_attr_getstack(&attr, &addr, &size);
+		pthread_attr_destroy(&attr);
+		top = static_cast<char*>(addr) + size;
+#endif
+		return top;
+	}
+
+	// Called from markStack, so the stack above this frame holds markStack's
+	// frame with the registers it spilled.
+	GC_NOINLINE void scanStack() {
+		volatile char here = 0;
+		scanRange(const_cast<const char*>(&here), stackTop());
+	}
+
+	// An object may be referenced only from a callee-saved register, so
+	// those are spilled into this frame before the stack is scanned. glibc's
+	// setjmp is no good for this: it mangles the saved frame and stack
+	// pointers.
+	GC_NOINLINE void markStack() {
+#if defined(__GNUC__) || defined(__clang__)
+		__builtin_unwind_init();
+		scanStack();
+		// Keeps the call above from becoming a tail call, which would
+		// restore the registers and release this frame first.
+		__asm__ __volatile__("" ::: "memory");
+#else
+		std::jmp_buf registers;
+		setjmp(registers);
+		scanRange(&registers, &registers + 1);
+		scanStack();
+#endif
+	}
+
+	void markRoots() {
+		gc::markInterpreterRoots();
+		for (std::vector<LObj>* roots : heap->vectorRoots) {
+			for (const LObj& o : *roots)
+				gc::mark(o);
+		}
+		markStack();
+	}
+
+	void drainMarkStack() {
+		while (!heap->markStack.empty()) {
+			Base_Object* obj = heap->markStack.back();
+			heap->markStack.pop_back();
+			obj->trace();
+		}
+	}
+
+	void sweepClass(SizeClass& sc) {
+		sc.freeList = nullptr;
+		std::vector<Block*> kept;
+		for (Block* block : sc.blocks) {
+			size_t liveCells = 0;
+			for (size_t i = 0; i < block->bump; ++i) {
+				if (!block->isLive(i)) continue;
+				Base_Object* obj = reinterpret_cast<Base_Object*>(block->cells() + i * block->cellSize);
+				if (obj->gcMark == gc::Marked) {
+					obj->gcMark = gc::Unmarked;
+					++liveCells;
+				}
+				else {
+					++heap->typeCounts[static_cast<size_t>(obj->type)].freed;
+					obj->~Base_Object();
+					block->setLive(i, false);
+				}
+			}
+			if (liveCells == 0 && block != sc.bumpBlock) {
+				freeBlock(block);
+				continue;
+			}
+			heap->liveBytes += liveCells * block->cellSize;
+			for (size_t i = block->bump; i-- > 0;) {
+				if (block->isLive(i)) continue;
+				FreeCell* cell = reinterpret_cast<FreeCell*>(block->cells() + i * block->cellSize);
+				cell->next = sc.freeList;
+				sc.freeList = cell;
+			}
+			kept.push_back(block);
+		}
+		sc.blocks.swap(kept);
+	}
+
+	void sweepLarge() {
+		for (auto it = heap->largeObjects.begin(); it != heap->largeObjects.end();) {
+			Base_Object* obj = reinterpret_cast<Base_Object*>(it->first);
+			if (obj->gcMark == gc::Marked) {
+				obj->gcMark = gc::Unmarked;
+				heap->liveBytes += it->second;
+				++it;
+			}
+			else {
+				++heap->typeCounts[static_cast<size_t>(obj->type)].freed;
+				obj->~Base_Object();
+				::operator delete(obj);
+				it = heap->largeObjects.erase(it);
+			}
+		}
+	}
+}
+
+gc::Heap* gc::createHeap(Heap* parent) {
+	return new Heap(parent);
+}
+
+// Runs the destructor of every object still in the heap and releases its
+// memory in one pass; nothing is traced.
+void gc::destroyHeap(Heap* h) {
+	for (SizeClass& sc : h->classes) {
+		for (Block* block : sc.blocks) {
+			for (size_t i = 0; i < block->bump; ++i) {
+				if (block->isLive(i))
+					reinterpret_cast<Base_Object*>(block->cells() + i * block->cellSize)->~Base_Object();
+			}
+			alignedFree(block);
+		}
+	}
+	for (auto& [addr, size] : h->largeObjects) {
+		Base_Object* obj = reinterpret_cast<Base_Object*>(addr);
+		obj->~Base_Object();
+		::operator delete(obj);
+	}
+	delete h;
+}
+
+gc::Heap* gc::currentHeap() {
+	return heap;
+}
+
+void gc::setCurrentHeap(Heap* h) {
+	heap = h;
+}
+
+bool gc::owns(Heap* h, const Base_Object* obj) {
+	uintptr_t addr = reinterpret_cast<uintptr_t>(obj);
+	return h->blockSet.count(addr & ~(BlockSize - 1)) != 0 || h->largeObjects.count(addr) != 0;
+}
+
+bool gc::isLocal(const Base_Object* obj) {
+	return heap->parent == nullptr || owns(heap, obj);
+}
+
+void gc::share(Heap* h) {
+	h->sharers.fetch_add(1, std::memory_order_relaxed);
+}
+
+void gc::unshare(Heap* h) {
+	h->sharers.fetch_sub(1, std::memory_order_release);
+}
+
+bool gc::isShared(Heap* h) {
+	return h->sharers.load(std::memory_order_acquire) != 0;
+}
+
+void* gc::allocate(size_t size, Type type) {
+	heap->allocatedSinceCollect += size;
+	++heap->allocations;
+	heap->bytesAllocated += size;
+	++heap->typeCounts[static_cast<size_t>(type)].allocated;
+	heap->peakSize = std::max(heap->peakSize, heap->liveBytes + heap->allocatedSinceCollect);
+	if (heap->deferDepth == 0 && (GCStress || heap->allocatedSinceCollect > heap->threshold))
+		collect();
+	if (size > LargeObjectSize)
+		return allocateLarge(size);
+	return allocateSmall(size);
+}
+
+void gc::abandon(void* cell, Type type) {
+	++heap->typeCounts[static_cast<size_t>(type)].freed;
+	auto it = heap->largeObjects.find(reinterpret_cast<uintptr_t>(cell));
+	if (it != heap->largeObjects.end()) {
+		::operator delete(cell);
+		heap->largeObjects.erase(it);
+		return;
+	}
+	Block* block = blockOf(cell);
+	block->setLive((static_cast<char*>(cell) - block->cells()) / block->cellSize, false);
+}
+
+void gc::collect() {
+	if (heap->collecting) return;
+	heap->collecting = true;
+	markRoots();
+	drainMarkStack();
+	while (gc::markInterpreterEphemerons())
+		drainMarkStack();
+	gc::sweepInterpreterWeakRefs();
+	heap->liveBytes = 0;
+	for (SizeClass& sc : heap->classes)
+		sweepClass(sc);
+	sweepLarge();
+	heap->allocatedSinceCollect = 0;
+	heap->threshold = std::max(InitialThreshold, heap->liveBytes);
+	++heap->collections;
+	heap->collecting = false;
+}
+
+void gc::mark(Base_Object* obj) {
+	if (obj == nullptr || (heap->parent != nullptr && !owns(heap, obj)) || obj->gcMark != Unmarked) return;
+	obj->gcMark = Marked;
+	heap->markStack.push_back(obj);
+}
+
+void gc::mark(const LObj& obj) {
+	mark(obj.get());
+}
+
+void gc::pushRoot(std::vector<LObj>* roots) {
+	heap->vectorRoots.push_back(roots);
+}
+
+// Roots are released in the reverse order of pushRoot.
+void gc::popRoot(std::vector<LObj>* roots) {
+	assert(!heap->vectorRoots.empty() && heap->vectorRoots.back() == roots);
+	heap->vectorRoots.pop_back();
+}
+
+void gc::deferCollection(bool defer) {
+	heap->deferDepth += defer ? 1 : -1;
+}
+
+size_t gc::heapSize() {
+	return heap->liveBytes + heap->allocatedSinceCollect;
+}
+
+size_t gc::collections() {
+	return heap->collections;
+}
+
+size_t gc::allocations() {
+	return heap->allocations;
+}
+
+const gc::TypeCounts& gc::typeCounts(Type type) {
+	return heap->typeCounts[static_cast<size_t>(type)];
+}
+
+size_t gc::bytesAllocated() {
+	return heap->bytesAllocated;
+}
+
+size_t gc::peakHeapSize() {
+	return heap->peakSize;
+}
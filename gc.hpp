@@ -0,0 +1,119 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+class Base_Object;
+class LObj;
+enum class Type : uint8_t;
+
+// Collect on every allocation; only useful for shaking out missing roots.
+constexpr auto GCStress = false;
+
+namespace gc {
+	// Mark byte values stored in every Base_Object.
+	constexpr uint8_t Unmarked = 0;
+	constexpr uint8_t Marked = 1;
+	constexpr uint8_t Immortal = 2;
+
+	// Every interpreter owns a heap. Allocation and collection work on the
+	// heap current on the calling thread, and only that thread's stack is
+	// scanned for roots.
+	struct Heap;
+	Heap* createHeap(Heap* parent = nullptr);
+	void destroyHeap(Heap* heap);
+	Heap* currentHeap();
+	void setCurrentHeap(Heap* heap);
+
+	// A parallel task allocates in a heap of its own whose parent is the
+	// heap of the interpreter that started it. The task reads objects of
+	// its ancestors but never marks or mutates them. An ancestor keeps
+	// collecting while it is shared with running tasks: the interpreter
+	// marks what it handed to them, keeps the values of globals it rebinds
+	// meanwhile, and waits for them before mutating an object in place.
+	bool owns(Heap* heap, const Base_Object* obj);
+	// False for objects a task only borrows from an ancestor heap.
+	bool isLocal(const Base_Object* obj);
+	void share(Heap* heap);
+	void unshare(Heap* heap);
+	bool isShared(Heap* heap);
+
+	void* allocate(size_t size, Type type);
+	void abandon(void* cell, Type type);
+	void collect();
+
+	void mark(Base_Object* obj);
+	void mark(const LObj& obj);
+
+	void pushRoot(std::vector<LObj>* roots);
+	void popRoot(std::vector<LObj>* roots);
+	void deferCollection(bool defer);
+
+	size_t heapSize();
+	size_t collections();
+	size_t allocations();
+
+	// Objects of one type allocated so far and those swept since; the
+	// difference is the number still on the heap.
+	struct TypeCounts {
+		size_t allocated = 0;
+		size_t freed = 0;
+	};
+	const TypeCounts& typeCounts(Type type);
+	size_t bytesAllocated();
+	size_t peakHeapSize();
+
+	// Defined by the interpreter: marks the current interpreter's symbols,
+	// environment and VM.
+	void markInterpreterRoots();
+	// Marks values held only for as long as their key is live; returns true
+	// if anything new was marked, so tracing must continue.
+	bool markInterpreterEphemerons();
+	// Drops weakly held entries whose key did not survive marking.
+	void sweepInterpreterWeakRefs();
+
+	// Keeps the elements of a C++-owned vector alive; the native stack is
+	// scanned directly, but vector storage lives on the malloc heap.
+	class VectorRoot {
+	private:
+		std::vector<LObj>& roots;
+
+	public:
+		VectorRoot(std::vector<LObj>& v)
+			: roots(v) {
+			pushRoot(&roots);
+		}
+		~VectorRoot() {
+			popRoot(&roots);
+		}
+		VectorRoot(const VectorRoot&) = delete;
+		VectorRoot& operator=(const VectorRoot&) = delete;
+	};
+
+	// Postpones collection while heap pointers sit in storage that is not
+	// traced, e.g. a std::vector<Node*> under construction.
+	class DeferScope {
+	public:
+		DeferScope() {
+			deferCollection(true);
+		}
+		~DeferScope() {
+			deferCollection(false);
+		}
+		DeferScope(const DeferScope&) = delete;
+		DeferScope& operator=(const DeferScope&) = delete;
+	};
+}
+
+template<typename T, typename... Args>
+T* gcNew(Args&&... args) {
+	void* cell = gc::allocate(sizeof(T), T::TypeTag);
+	try {
+		return new (cell) T(std::forward<Args>(args)...);
+	}
+	catch (...) {
+		gc::abandon(cell, T::TypeTag);
+		throw;
+	}
+}
@@ -0,0 +1,186 @@
+#include "hashtable.hpp"
+#include "number.hpp"
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace {
+	constexpr int HashBudget = 32;
+
+	size_t mix(uint64_t x) {
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ull;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebull;
+		x ^= x >> 31;
+		return static_cast<size_t>(x);
+	}
+
+	// The bits equal? compares floats by: 0.0 and -0.0 are one key, and so
+	// is every NaN, which numberCompare would call equal to any float.
+	uint64_t floatKey(double d) {
+		if (d == 0) d = 0;
+		if (std::isnan(d)) d = std::numeric_limits<double>::quiet_NaN();
+		uint64_t bits;
+		std::memcpy(&bits, &d, sizeof(bits));
+		return bits;
+	}
+
+	size_t hashAtom(const LObj& o) {
+		switch (o.type()) {
+		case Type::Fixnum:
+			return mix(static_cast<uint64_t>(o.fixnumValue()));
+		case Type::Symbol:
+			return o.getAs<Symbol>().hash;
+		case Type::String:
+			return Symbol::hashName(o.getAs<String>().value);
+		case Type::Float:
+			return mix(floatKey(o.getAs<Float>().value));
+		case Type::Bignum: {
+			const Bignum& b = o.getAs<Bignum>();
+			uint64_t h = b.negative;
+			for (uint32_t limb : b.magnitude)
+				h = mix(h * 31 + limb);
+			return static_cast<size_t>(h);
+		}
+		default:
+			return mix(reinterpret_cast<uintptr_t>(o.get()));
+		}
+	}
+}
+
+bool equal(const LObj& a, const LObj& b) {
+	std::vector<std::pair<LObj, LObj>> pending{ { a, b } };
+	while (!pending.empty()) {
+		auto [x, y] = pending.back();
+		pending.pop_back();
+		if (x == y) continue;
+		Type type = x.type();
+		if (type != y.type()) return false;
+		switch (type) {
+		case Type::Cons:
+			pending.emplace_back(x.getAs<Cons>().cdr, y.getAs<Cons>().cdr);
+			pending.emplace_back(x.getAs<Cons>().car, y.getAs<Cons>().car);
+			break;
+		case Type::Vector: {
+			const std::vector<LObj>& xs = x.getAs<Vector>().values;
+			const std::vector<LObj>& ys = y.getAs<Vector>().values;
+			if (xs.size() != ys.size()) return false;
+			for (size_t i = xs.size(); i-- > 0;)
+				pending.emplace_back(xs[i], ys[i]);
+			break;
+		}
+		case Type::String:
+			if (x.getAs<String>().value != y.getAs<String>().value) return false;
+			break;
+		case Type::Bignum:
+			if (numberCompare(x, y) != 0) return false;
+			break;
+		case Type::Float:
+			if (floatKey(x.getAs<Float>().value) != floatKey(y.getAs<Float>().value)) return false;
+			break;
+		default:
+			return false;
+		}
+	}
+	return true;
+}
+
+size_t hashValue(const LObj& o) {
+	std::vector<LObj> pending{ o };
+	uint64_t h = 0;
+	for (int budget = HashBudget; budget > 0 && !pending.empty(); --budget) {
+		LObj x = pending.back();
+		pending.pop_back();
+		Type type = x.type();
+		if (type == Type::Cons) {
+			h = mix(h * 31 + static_cast<uint8_t>(type));
+			pending.push_back(x.getAs<Cons>().cdr);
+			pending.push_back(x.getAs<Cons>().car);
+		}
+		else if (type == Type::Vector) {
+			const std::vector<LObj>& values = x.getAs<Vector>().values;
+			h = mix(h * 31 + values.size());
+			for (size_t i = values.size(); i-- > 0;)
+				pending.push_back(values[i]);
+		}
+		else {
+			h = mix(h * 31 + hashAtom(x));
+		}
+	}
+	return static_cast<size_t>(h);
+}
+
+HashTable::HashTable(size_t capacity)
+	: Base_Object(TypeTag) {
+	size_t size = 8;
+	while (size < capacity * 2) size *= 2;
+	entries.resize(size);
+}
+
+HashTable::Entry* HashTable::find(const LObj& key, size_t hash) {
+	size_t mask = entries.size() - 1;
+	for (size_t i = hash & mask; entries[i].slot != Slot::Empty; i = (i + 1) & mask) {
+		Entry& e = entries[i];
+		if (e.slot == Slot::Full && e.hash == hash && equal(e.key, key))
+			return &e;
+	}
+	return nullptr;
+}
+
+void HashTable::rehash(size_t capacity) {
+	std::vector<Entry> old(capacity);
+	old.swap(entries);
+	size_t mask = entries.size() - 1;
+	for (Entry& e : old) {
+		if (e.slot != Slot::Full) continue;
+		size_t i = e.hash & mask;
+		while (entries[i].slot != Slot::Empty)
+			i = (i + 1) & mask;
+		entries[i] = e;
+	}
+	used = count;
+}
+
+LObj* HashTable::lookup(const LObj& key) {
+	Entry* e = find(key, hashValue(key));
+	return e != nullptr ? &e->value : nullptr;
+}
+
+void HashTable::set(const LObj& key, const LObj& value) {
+	size_t hash = hashValue(key);
+	if (Entry* e = find(key, hash)) {
+		e->value = value;
+		return;
+	}
+	if ((used + 1) * 4 > entries.size() * 3) {
+		size_t size = 8;
+		while (size < (count + 1) * 2) size *= 2;
+		rehash(size);
+	}
+	size_t mask = entries.size() - 1;
+	size_t i = hash & mask;
+	while (entries[i].slot == Slot::Full)
+		i = (i + 1) & mask;
+	if (entries[i].slot == Slot::Empty) ++used;
+	entries[i] = { key, value, hash, Slot::Full };
+	++count;
+}
+
+bool HashTable::remove(const LObj& key) {
+	Entry* e = find(key, hashValue(key));
+	if (e == nullptr) return false;
+	*e = Entry();
+	e->slot = Slot::Deleted;
+	--count;
+	return true;
+}
+
+void HashTable::trace() const {
+	for (const Entry& e : entries) {
+		if (e.slot == Slot::Full) {
+			gc::mark(e.key);
+			gc::mark(e.value);
+		}
+	}
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include "lisp.hpp"
+
+// Structural equality: numbers of the same kind by value, strings by
+// contents, conses and vectors element by element, anything else by identity.
+bool equal(const LObj& a, const LObj& b);
+
+// A hash consistent with equal(). Only a bounded prefix of a large structure
+// contributes, so hashing a long list is cheap.
+size_t hashValue(const LObj& o);
+
+// Open addressing with linear probing over a power-of-two array. Removed
+// entries leave a tombstone that is dropped at the next rehash.
+class HashTable : public Base_Object {
+private:
+	enum class Slot : uint8_t { Empty, Full, Deleted };
+
+	struct Entry {
+		LObj key;
+		LObj value;
+		size_t hash = 0;
+		Slot slot = Slot::Empty;
+	};
+
+	std::vector<Entry> entries;
+	size_t count = 0;
+	size_t used = 0;
+
+	Entry* find(const LObj& key, size_t hash);
+	void rehash(size_t capacity);
+
+public:
+	static constexpr Type TypeTag = Type::HashTable;
+	// Most entries make-hash-table reserves room for.
+	static constexpr size_t MaxCapacity = size_t(1) << 27;
+
+	explicit HashTable(size_t capacity = 0);
+
+	LObj* lookup(const LObj& key);
+	void set(const LObj& key, const LObj& value);
+	bool remove(const LObj& key);
+
+	size_t size() const {
+		return count;
+	}
+
+	template<typename F>
+	void forEach(F f) const {
+		for (const Entry& e : entries) {
+			if (e.slot == Slot::Full)
+				f(e.key, e.value);
+		}
+	}
+
+	void trace() const override;
+
+	std::ostream& operator<<(std::ostream& os) const override {
+		os << "<HashTable>";
+		return os;
+	}
+};
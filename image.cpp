@@ -0,0 +1,594 @@
+#include "image.hpp"
+#include "hashtable.hpp"
+#include "interpreter.hpp"
+#include "number.hpp"
+#include "reader.hpp"
+#include "vm.hpp"
+#include <cstring>
+#include <filesystem>
+#include <unordered_map>
+
+namespace {
+	// "LIMG" in the first four bytes of a heap image.
+	constexpr uint32_t ImageMagic = 0x474d494c;
+	// "LFSL" in the first four bytes of a compiled file.
+	constexpr uint32_t CompiledMagic = 0x4c53464c;
+
+	enum class ValueTag : uint8_t { Empty, Fixnum, Symbol, Object };
+
+	class GraphWriter {
+	private:
+		std::unordered_map<const Symbol*, uint32_t> symbolIndex;
+		std::vector<const Symbol*> symbols;
+		std::unordered_map<const Base_Object*, uint32_t> objectIndex;
+		std::vector<const Base_Object*> objects;
+		std::vector<const Base_Object*> pending;
+		std::string out;
+
+		void put8(uint8_t v) {
+			out.push_back(static_cast<char>(v));
+		}
+		void put16(uint16_t v) {
+			out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+		}
+		void put32(uint32_t v) {
+			out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+		}
+		void put64(uint64_t v) {
+			out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+		}
+		void putString(std::string_view s) {
+			put32(static_cast<uint32_t>(s.size()));
+			out.append(s);
+		}
+
+		void addSymbol(const Symbol* symbol) {
+			if (symbol != nullptr && symbolIndex.emplace(symbol, static_cast<uint32_t>(symbols.size())).second)
+				symbols.push_back(symbol);
+		}
+
+		void add(LObj o) {
+			if (o.isSymbol())
+				addSymbol(&o.getAs<Symbol>());
+			else if (o.isHeap())
+				add(o.get());
+		}
+
+		void add(const Base_Object* obj) {
+			if (obj != nullptr && objectIndex.emplace(obj, static_cast<uint32_t>(objects.size())).second) {
+				objects.push_back(obj);
+				pending.push_back(obj);
+			}
+		}
+
+		// Finds every object and symbol reachable from `obj`.
+		void addChildren(const Base_Object* obj) {
+			switch (obj->type) {
+			case Type::Cons:
+				add(obj->getAs<Cons>().car);
+				add(obj->getAs<Cons>().cdr);
+				break;
+			case Type::Vector:
+				for (const LObj& o : obj->getAs<Vector>().values)
+					add(o);
+				break;
+			case Type::HashTable:
+				obj->getAs<HashTable>().forEach([this](const LObj& key, const LObj& value) {
+					add(key);
+					add(value);
+					});
+				break;
+			case Type::Proc:
+				add(obj->getAs<Proc>().code);
+				add(obj->getAs<Proc>().env);
+				break;
+			case Type::Macro:
+				add(obj->getAs<Macro>().code);
+				add(obj->getAs<Macro>().env);
+				break;
+			case Type::Frame: {
+				const Frame& frame = obj->getAs<Frame>();
+				add(frame.parent);
+				for (uint16_t i = 0; i < frame.size; ++i)
+					add(frame.values()[i]);
+				break;
+			}
+			case Type::Code: {
+				const Code& code = obj->getAs<Code>();
+				for (const LObj& c : code.constants)
+					add(c);
+				for (const Symbol* s : code.slotNames)
+					addSymbol(s);
+				addSymbol(code.name);
+				break;
+			}
+			case Type::String:
+			case Type::Bignum:
+			case Type::Float:
+			case Type::PredefinedProc:
+				break;
+			default:
+				throw "Cannot save environments, futures or syntax trees";
+			}
+		}
+
+		void putValue(LObj o) {
+			if (o == nullptr) {
+				put8(static_cast<uint8_t>(ValueTag::Empty));
+			}
+			else if (o.isFixnum()) {
+				put8(static_cast<uint8_t>(ValueTag::Fixnum));
+				put64(static_cast<uint64_t>(o.fixnumValue()));
+			}
+			else if (o.isSymbol()) {
+				put8(static_cast<uint8_t>(ValueTag::Symbol));
+				put32(symbolIndex.at(&o.getAs<Symbol>()));
+			}
+			else {
+				put8(static_cast<uint8_t>(ValueTag::Object));
+				put32(objectIndex.at(o.get()));
+			}
+		}
+
+		template<typename T>
+		void putValue(T* obj) {
+			putValue(obj != nullptr ? LObj(obj) : LObj());
+		}
+
+		void putPayload(const Base_Object* obj) {
+			switch (obj->type) {
+			case Type::Cons:
+				putValue(obj->getAs<Cons>().car);
+				putValue(obj->getAs<Cons>().cdr);
+				break;
+			case Type::String:
+				putString(obj->getAs<String>().value);
+				break;
+			case Type::Bignum: {
+				const Bignum& n = obj->getAs<Bignum>();
+				put8(n.negative);
+				put32(static_cast<uint32_t>(n.magnitude.size()));
+				for (uint32_t digit : n.magnitude)
+					put32(digit);
+				break;
+			}
+			case Type::Float: {
+				uint64_t bits;
+				std::memcpy(&bits, &obj->getAs<Float>().value, sizeof(bits));
+				put64(bits);
+				break;
+			}
+			case Type::Vector: {
+				const std::vector<LObj>& values = obj->getAs<Vector>().values;
+				put32(static_cast<uint32_t>(values.size()));
+				for (const LObj& o : values)
+					putValue(o);
+				break;
+			}
+			case Type::HashTable:
+				put32(static_cast<uint32_t>(obj->getAs<HashTable>().size()));
+				obj->getAs<HashTable>().forEach([this](const LObj& key, const LObj& value) {
+					putValue(key);
+					putValue(value);
+					});
+				break;
+			case Type::PredefinedProc:
+				putString(obj->getAs<PredefinedProc>().name);
+				break;
+			case Type::Proc:
+				putValue(obj->getAs<Proc>().code);
+				putValue(obj->getAs<Proc>().env);
+				break;
+			case Type::Macro:
+				putValue(obj->getAs<Macro>().code);
+				putValue(obj->getAs<Macro>().env);
+				break;
+			case Type::Frame: {
+				const Frame& frame = obj->getAs<Frame>();
+				put16(frame.size);
+				putValue(frame.parent);
+				for (uint16_t i = 0; i < frame.size; ++i)
+					putValue(frame.values()[i]);
+				break;
+			}
+			case Type::Code: {
+				const Code& code = obj->getAs<Code>();
+				putString(std::string_view(reinterpret_cast<const char*>(code.bytecode.data()), code.bytecode.size()));
+				put32(static_cast<uint32_t>(code.constants.size()));
+				for (const LObj& c : code.constants)
+					putValue(c);
+				put32(static_cast<uint32_t>(code.slotNames.size()));
+				for (Symbol* s : code.slotNames)
+					putValue(s);
+				put16(code.parameterCount);
+				put16(code.localCount);
+				put32(code.maxStack);
+				put8(code.hasRest | code.isMacro << 1 | code.isToplevel << 2);
+				putValue(code.name);
+				break;
+			}
+			default:
+				break;
+			}
+		}
+
+	public:
+		void write(std::ostream& os, uint32_t magic, const std::vector<LObj>& roots) {
+			for (const LObj& root : roots)
+				add(root);
+			while (!pending.empty()) {
+				const Base_Object* obj = pending.back();
+				pending.pop_back();
+				addChildren(obj);
+			}
+
+			put32(magic);
+			put32(image::Version);
+			put32(static_cast<uint32_t>(symbols.size()));
+			for (const Symbol* symbol : symbols)
+				putString(symbol->name);
+			put32(static_cast<uint32_t>(objects.size()));
+			for (const Base_Object* obj : objects) {
+				put8(static_cast<uint8_t>(obj->type));
+				size_t lengthAt = out.size();
+				put32(0);
+				putPayload(obj);
+				uint32_t length = static_cast<uint32_t>(out.size() - lengthAt - sizeof(uint32_t));
+				std::memcpy(&out[lengthAt], &length, sizeof(length));
+			}
+			put32(static_cast<uint32_t>(roots.size()));
+			for (const LObj& root : roots)
+				putValue(root);
+			os.write(out.data(), out.size());
+		}
+	};
+
+	class Cursor {
+	private:
+		const char* pos;
+		const char* end;
+
+		template<typename T>
+		T get() {
+			T v;
+			std::memcpy(&v, bytes(sizeof(T)).data(), sizeof(T));
+			return v;
+		}
+
+	public:
+		explicit Cursor(std::string_view data)
+			: pos(data.data()), end(data.data() + data.size()) {}
+
+		std::string_view bytes(size_t n) {
+			if (static_cast<size_t>(end - pos) < n)
+				throw "Corrupt image or compiled file";
+			std::string_view s(pos, n);
+			pos += n;
+			return s;
+		}
+
+		uint8_t u8() {
+			return get<uint8_t>();
+		}
+		uint16_t u16() {
+			return get<uint16_t>();
+		}
+		uint32_t u32() {
+			return get<uint32_t>();
+		}
+		uint64_t u64() {
+			return get<uint64_t>();
+		}
+		std::string_view string() {
+			return bytes(u32());
+		}
+
+		// A count of items that each take at least `itemSize` bytes, so a
+		// corrupt count is caught before anything is allocated for it.
+		uint32_t count(size_t itemSize) {
+			uint32_t n = u32();
+			if (n > static_cast<size_t>(end - pos) / itemSize)
+				throw "Corrupt image or compiled file";
+			return n;
+		}
+	};
+
+	// Objects are created in three passes: empty shells first, so that
+	// references can be resolved in any order, then their fields, and hash
+	// tables last because hashing a key looks into it.
+	class GraphReader {
+	private:
+		struct Record {
+			Type type;
+			std::string_view payload;
+		};
+
+		std::vector<Symbol*> symbols;
+		std::vector<Record> records;
+		std::vector<LObj> objects;
+
+		LObj value(Cursor& in) {
+			switch (static_cast<ValueTag>(in.u8())) {
+			case ValueTag::Empty:
+				return LObj();
+			case ValueTag::Fixnum:
+				return LObj::fixnum(static_cast<intptr_t>(in.u64()));
+			case ValueTag::Symbol: {
+				uint32_t i = in.u32();
+				if (i >= symbols.size()) throw "Corrupt image or compiled file";
+				return LObj(symbols[i]);
+			}
+			case ValueTag::Object: {
+				uint32_t i = in.u32();
+				if (i >= objects.size()) throw "Corrupt image or compiled file";
+				return objects[i];
+			}
+			}
+			throw "Corrupt image or compiled file";
+		}
+
+		template<typename T>
+		T* object(Cursor& in) {
+			LObj o = value(in);
+			if (o == nullptr)
+				return nullptr;
+			if (!o.typep<T>())
+				throw "Corrupt image or compiled file";
+			return &o.getAs<T>();
+		}
+
+		Symbol* symbol(Cursor& in) {
+			LObj o = value(in);
+			if (o == nullptr)
+				return nullptr;
+			if (!o.isSymbol())
+				throw "Corrupt image or compiled file";
+			return &o.getAs<Symbol>();
+		}
+
+		LObj createShell(const Record& record) {
+			Cursor in(record.payload);
+			switch (record.type) {
+			case Type::Cons:
+				return makeObj<Cons>(LObj(), LObj());
+			case Type::String:
+				return makeObj<String>(std::string(in.string()));
+			case Type::Bignum: {
+				bool negative = in.u8() != 0;
+				std::vector<uint32_t> magnitude(in.count(sizeof(uint32_t)));
+				for (uint32_t& digit : magnitude)
+					digit = in.u32();
+				return makeObj<Bignum>(negative, std::move(magnitude));
+			}
+			case Type::Float: {
+				uint64_t bits = in.u64();
+				double d;
+				std::memcpy(&d, &bits, sizeof(d));
+				return makeObj<Float>(d);
+			}
+			case Type::Vector:
+				return makeObj<Vector>(std::vector<LObj>(in.count(1)));
+			case Type::HashTable:
+				return makeObj<HashTable>(in.count(2));
+			case Type::PredefinedProc: {
+				PredefinedProc* builtin = rootEnvironment()->findBuiltin(in.string());
+				if (builtin == nullptr)
+					throw "Image file refers to an unknown builtin";
+				return LObj(builtin);
+			}
+			case Type::Proc:
+				return makeObj<Proc>(nullptr, nullptr);
+			case Type::Macro:
+				return makeObj<Macro>(nullptr, nullptr);
+			case Type::Frame:
+				return LObj(Frame::create(nullptr, in.u16()));
+			case Type::Code:
+				return makeObj<Code>();
+			default:
+				throw "Corrupt image or compiled file";
+			}
+		}
+
+		void fill(const Record& record, LObj o) {
+			Cursor in(record.payload);
+			switch (record.type) {
+			case Type::Cons:
+				o.getAs<Cons>().car = value(in);
+				o.getAs<Cons>().cdr = value(in);
+				break;
+			case Type::Vector:
+				in.u32();
+				for (LObj& v : o.getAs<Vector>().values)
+					v = value(in);
+				break;
+			case Type::Proc:
+				o.getAs<Proc>().code = object<Code>(in);
+				o.getAs<Proc>().env = object<Frame>(in);
+				break;
+			case Type::Macro:
+				o.getAs<Macro>().code = object<Code>(in);
+				o.getAs<Macro>().env = object<Frame>(in);
+				break;
+			case Type::Frame: {
+				Frame& frame = o.getAs<Frame>();
+				in.u16();
+				frame.parent = object<Frame>(in);
+				for (uint16_t i = 0; i < frame.size; ++i)
+					frame.values()[i] = value(in);
+				break;
+			}
+			case Type::Code: {
+				Code& code = o.getAs<Code>();
+				std::string_view bytecode = in.string();
+				code.bytecode.assign(bytecode.begin(), bytecode.end());
+				code.constants.resize(in.count(1));
+				for (LObj& c : code.constants)
+					c = value(in);
+				code.slotNames.resize(in.count(1));
+				for (Symbol*& s : code.slotNames)
+					s = symbol(in);
+				code.parameterCount = in.u16();
+				code.localCount = in.u16();
+				code.maxStack = in.u32();
+				uint8_t flags = in.u8();
+				code.hasRest = flags & 1;
+				code.isMacro = flags & 2;
+				code.isToplevel = flags & 4;
+				code.name = symbol(in);
+				break;
+			}
+			default:
+				break;
+			}
+		}
+
+		void fillTable(const Record& record, LObj o) {
+			Cursor in(record.payload);
+			for (uint32_t n = in.u32(); n > 0; --n) {
+				LObj key = value(in);
+				o.getAs<HashTable>().set(key, value(in));
+			}
+		}
+
+	public:
+		void read(std::string_view data, uint32_t magic, std::vector<LObj>& roots) {
+			gc::DeferScope defer;
+			Cursor in(data);
+			if (in.u32() != magic)
+				throw "Wrong file format";
+			if (in.u32() != image::Version)
+				throw "File was written by another version of the interpreter";
+			symbols.resize(in.count(sizeof(uint32_t)));
+			for (Symbol*& symbol : symbols)
+				symbol = symbolTable().intern(in.string());
+			records.resize(in.count(1 + sizeof(uint32_t)));
+			for (Record& record : records) {
+				uint8_t type = in.u8();
+				if (type >= static_cast<uint8_t>(Type::Count))
+					throw "Corrupt image or compiled file";
+				record.type = static_cast<Type>(type);
+				record.payload = in.string();
+			}
+			for (const Record& record : records)
+				objects.push_back(createShell(record));
+			for (size_t i = 0; i < records.size(); ++i)
+				fill(records[i], objects[i]);
+			for (size_t i = 0; i < records.size(); ++i) {
+				if (records[i].type == Type::HashTable)
+					fillTable(records[i], objects[i]);
+			}
+			verifyLoaded(objects);
+			for (uint32_t n = in.u32(); n > 0; --n)
+				roots.push_back(value(in));
+		}
+	};
+}
+
+void image::write(std::ostream& os, uint32_t magic, const std::vector<LObj>& roots) {
+	GraphWriter().write(os, magic, roots);
+}
+
+void image::read(std::string_view data, uint32_t magic, std::vector<LObj>& roots) {
+	GraphReader().read(data, magic, roots);
+}
+
+// The roots of an image are the gensym counter followed by (symbol, value)
+// pairs, one per global variable.
+void saveImage(const std::string& path) {
+	Interpreter& interpreter = Interpreter::current();
+	std::vector<LObj> roots{ LObj::fixnum(interpreter.gensymCounter) };
+	gc::VectorRoot root(roots);
+	interpreter.environment->forEachGlobal([&](Symbol* symbol, LObj value) {
+		roots.push_back(LObj(symbol));
+		roots.push_back(value);
+		});
+	std::ofstream out(path, std::ios::binary);
+	if (!out)
+		throw "Cannot open image file";
+	image::write(out, ImageMagic, roots);
+	if (!out)
+		throw "Cannot write image file";
+}
+
+void loadImage(const std::string& path) {
+	MappedFile file(path);
+	if (!file.isOpen())
+		throw "Cannot open image file";
+	std::vector<LObj> roots;
+	gc::VectorRoot root(roots);
+	image::read(file.view(), ImageMagic, roots);
+	if (roots.empty() || !roots[0].isFixnum() || roots.size() % 2 != 1)
+		throw "Corrupt image or compiled file";
+	Interpreter& interpreter = Interpreter::current();
+	interpreter.gensymCounter = std::max(interpreter.gensymCounter, static_cast<int>(roots[0].fixnumValue()));
+	Env* env = interpreter.environment;
+	for (size_t i = 1; i < roots.size(); i += 2) {
+		Symbol* symbol = roots[i].isSymbol() ? &roots[i].getAs<Symbol>() : nullptr;
+		if (symbol == nullptr)
+			throw "Corrupt image or compiled file";
+		// Rebinding a builtin to itself would mark it rebound and turn off
+		// the VM's open-coded calls to it.
+		if (env->globalValue(symbol) != roots[i + 1])
+			env->bind(roots[i + 1], symbol);
+	}
+}
+
+std::string compiledPath(const std::string& source) {
+	return std::filesystem::path(source).replace_extension(".fasl").string();
+}
+
+bool hasCurrentCompiled(const std::string& source) {
+	std::error_code ec;
+	auto compiled = std::filesystem::last_write_time(compiledPath(source), ec);
+	if (ec)
+		return false;
+	auto original = std::filesystem::last_write_time(source, ec);
+	return ec || compiled >= original;
+}
+
+// The roots of a compiled file are the Code of its top-level forms. It is
+// written under a temporary name and renamed, so a reader never sees it
+// half written.
+void compileFile(const std::string& source, Env& env) {
+	MappedFile file(source);
+	if (!file.isOpen())
+		throw "Cannot open source file";
+	std::vector<LObj> forms;
+	gc::VectorRoot root(forms);
+	VM& machine = Interpreter::current().machine;
+	Reader reader(file.view());
+	while (!reader.atEnd()) {
+		Code* code = compile(analyze(env.macroExpand(reader.read())));
+		forms.push_back(LObj(code));
+		machine.execute(code, &env);
+	}
+	std::string path = compiledPath(source);
+	std::string temporary = path + ".tmp";
+	{
+		std::ofstream out(temporary, std::ios::binary);
+		if (!out)
+			throw "Cannot open compiled file";
+		image::write(out, CompiledMagic, forms);
+		if (!out)
+			throw "Cannot write compiled file";
+	}
+	std::error_code ec;
+	std::filesystem::rename(temporary, path, ec);
+	if (ec)
+		throw "Cannot write compiled file";
+}
+
+void loadCompiled(const std::string& path, Env& env) {
+	MappedFile file(path);
+	if (!file.isOpen())
+		throw "Cannot open compiled file";
+	std::vector<LObj> forms;
+	gc::VectorRoot root(forms);
+	image::read(file.view(), CompiledMagic, forms);
+	VM& machine = Interpreter::current().machine;
+	for (const LObj& form : forms) {
+		if (!form.typep<Code>() || !form.getAs<Code>().isToplevel)
+			throw "Corrupt compiled file";
+		machine.execute(&form.getAs<Code>(), &env);
+	}
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include "lisp.hpp"
+
+// A binary form of object graphs, shared by heap images and compiled files:
+//   magic, version
+//   symbol names, each length-prefixed
+//   objects, each a type byte and a length-prefixed payload
+//   the root values
+// Values refer to symbols and objects by index, so sharing and cycles
+// survive. Builtins are written by name and relinked to the builtins of the
+// loading interpreter. Numbers are in the byte order of the host.
+namespace image {
+	// Bumped whenever the encoding or the bytecode changes.
+	constexpr uint32_t Version = 2;
+
+	void write(std::ostream& os, uint32_t magic, const std::vector<LObj>& roots);
+	// Appends the roots stored in `data` to `roots`, which the caller roots.
+	void read(std::string_view data, uint32_t magic, std::vector<LObj>& roots);
+}
+
+// Writes the global variables of the current interpreter to `path`.
+void saveImage(const std::string& path);
+// Defines the global variables saved in `path` in the current interpreter.
+void loadImage(const std::string& path);
+
+// A compiled file holds the top-level forms of a source file, expanded and
+// compiled, and sits next to it with the extension .fasl.
+std::string compiledPath(const std::string& source);
+// True if the compiled file of `source` is at least as new as `source`.
+bool hasCurrentCompiled(const std::string& source);
+// Evaluates the source file as load does, since later forms are expanded
+// and analyzed with what earlier ones define, and writes the compiled file.
+void compileFile(const std::string& source, Env& env);
+void loadCompiled(const std::string& path, Env& env);
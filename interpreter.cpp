@@ -0,0 +1,75 @@
+#include "interpreter.hpp"
+#include "parallel.hpp"
+#include "reader.hpp"
+#include <utility>
+
+thread_local Interpreter* Interpreter::active = nullptr;
+
+Interpreter::Interpreter()
+	: heap(gc::createHeap()), machine(profiler) {
+	Scope scope(*this);
+	environment = Env::createEnvironment();
+}
+
+Interpreter::Interpreter(Interpreter& p)
+	: heap(nullptr), machine(profiler) {
+	beginTask(p);
+}
+
+// Tasks still reading this heap are waited for before it is freed.
+Interpreter::~Interpreter() {
+	if (heap == nullptr)
+		return;
+	if (gc::isShared(heap))
+		ThreadPool::shared().helpUntil([this] { return !gc::isShared(heap); });
+	gc::destroyHeap(heap);
+}
+
+void Interpreter::beginTask(Interpreter& p) {
+	heap = gc::createHeap(p.heap);
+	parent = &p;
+	environment = p.environment;
+}
+
+gc::Heap* Interpreter::endTask() {
+	macroCache.clear();
+	profiler = Profiler();
+	parent = nullptr;
+	environment = nullptr;
+	return std::exchange(heap, nullptr);
+}
+
+Interpreter::Scope::Scope(Interpreter& interpreter)
+	: previous(active), previousHeap(gc::currentHeap()) {
+	active = &interpreter;
+	gc::setCurrentHeap(interpreter.heap);
+}
+
+Interpreter::Scope::~Scope() {
+	active = previous;
+	gc::setCurrentHeap(previousHeap);
+}
+
+LObj Interpreter::evaluate(std::string_view source) {
+	Scope scope(*this);
+	Reader reader(source);
+	LObj result;
+	while (!reader.atEnd())
+		result = environment->evalTop(reader.read());
+	return result;
+}
+
+SymbolTable& symbolTable() {
+	Interpreter& interpreter = Interpreter::current();
+	if (interpreter.parent != nullptr)
+		throw "Cannot intern symbols inside a parallel task";
+	return interpreter.symbols;
+}
+
+MacroCache& macroCache() {
+	return Interpreter::current().macroCache;
+}
+
+Env* rootEnvironment() {
+	return Interpreter::current().environment;
+}
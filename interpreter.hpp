@@ -0,0 +1,71 @@
+#pragma once
+#include "lisp.hpp"
+#include "profiler.hpp"
+#include "vm.hpp"
+#include <memory>
+
+class Task;
+
+// One self-contained interpreter: its own heap, symbol table, global
+// environment, VM and counters. The runtime finds these through the
+// interpreter current on the calling thread, so an interpreter is used by
+// one thread at a time, inside a Scope; separate interpreters can run on
+// separate threads concurrently. Values of one interpreter must not be
+// handed to another, except to and from its parallel tasks.
+class Interpreter {
+private:
+	static thread_local Interpreter* active;
+
+	gc::Heap* heap;
+
+public:
+	// Set while the interpreter runs a parallel task of `parent`: it shares
+	// the parent's global environment and allocates in a child heap.
+	Interpreter* parent = nullptr;
+	SymbolTable symbols;
+	MacroCache macroCache;
+	Profiler profiler;
+	VM machine;
+	Env* environment = nullptr;
+	int gensymCounter = 0;
+	// Tasks started from this interpreter, whose roots it marks.
+	std::vector<std::weak_ptr<Task>> tasks;
+
+	Interpreter();
+	explicit Interpreter(Interpreter& parent);
+	~Interpreter();
+	Interpreter(const Interpreter&) = delete;
+	Interpreter& operator=(const Interpreter&) = delete;
+
+	static Interpreter& current() {
+		return *active;
+	}
+
+	gc::Heap* ownHeap() const {
+		return heap;
+	}
+
+	// A task interpreter is reused from task to task, so that its VM stack
+	// and tables are allocated once: each task starts it with a fresh child
+	// heap of `parent`, and ending the task hands that heap, which holds
+	// the task's result, over to the caller.
+	void beginTask(Interpreter& parent);
+	gc::Heap* endTask();
+
+	// Makes an interpreter current on this thread until the scope ends.
+	class Scope {
+	private:
+		Interpreter* previous;
+		gc::Heap* previousHeap;
+
+	public:
+		explicit Scope(Interpreter& interpreter);
+		~Scope();
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+	};
+
+	// Reads and evaluates every form in `source` in a Scope of its own and
+	// returns the last value.
+	LObj evaluate(std::string_view source);
+};
@@ -1,741 +1,966 @@
 #include "lisp.hpp"
+#include "number.hpp"
+#include "hashtable.hpp"
+#include "image.hpp"
+#include "profiler.hpp"
+#include "parallel.hpp"
+#include "reader.hpp"
+#include "interpreter.hpp"
+#include "vm.hpp"
+#include <iomanip>
+#include <new>
+
+namespace Symbols {
+	Symbol Null("null", true);
+	Symbol T("t", true);
+	Symbol F("f", false);
+	Symbol Quote("quote", false);
+	Symbol If("if", false);
+	Symbol Do("do", false);
+	Symbol Define("define", false);
+	Symbol Set("set!", false);
+	Symbol Let("let", false);
+	Symbol LetStar("let*", false);
+	Symbol Lambda("lambda", false);
+	Symbol Macro("macro", false);
+	Symbol Exit("exit", true);
+	Symbol Future("future", false);
+}
 
-int totalSym = 0;
-std::map<std::string, BObjSharedPtr> sMap;
-EnvSPtr Environment;
+namespace {
+	Symbol* const StaticSymbols[] = { &Symbols::Null, &Symbols::T, &Symbols::F, &Symbols::Quote, &Symbols::If,
+		&Symbols::Do, &Symbols::Define, &Symbols::Set, &Symbols::Let, &Symbols::LetStar,
+		&Symbols::Lambda, &Symbols::Macro, &Symbols::Exit, &Symbols::Future };
+}
 
-bool Base_Object::isnull() const {
-	return this->typep<Symbol>() && this->getAs<Symbol>().name == "null";
+SymbolTable::SymbolTable()
+	: slots(1024) {
+	for (Symbol* s : StaticSymbols)
+		insert(s);
 }
 
-BObjSharedPtr registerSymbol(std::string name) {
-	auto it = sMap.find(name);
-	BObjSharedPtr objPtr;
-	if (it == sMap.end()) {
-		objPtr = std::make_shared<Symbol>(name);
-		sMap[name] = objPtr;
+void SymbolTable::insert(Symbol* symbol) {
+	size_t mask = slots.size() - 1;
+	size_t i = symbol->hash & mask;
+	while (slots[i] != nullptr)
+		i = (i + 1) & mask;
+	slots[i] = symbol;
+	++count;
+}
+
+Symbol* SymbolTable::intern(std::string_view name) {
+	size_t hash = Symbol::hashName(name);
+	size_t mask = slots.size() - 1;
+	for (size_t i = hash & mask; slots[i] != nullptr; i = (i + 1) & mask) {
+		if (slots[i]->hash == hash && slots[i]->name == name)
+			return slots[i];
 	}
-	else {
-		objPtr = it->second;
+	Symbol* symbol = gcNew<Symbol>(name);
+	if ((count + 1) * 2 > slots.size()) {
+		std::vector<Symbol*> old(slots.size() * 2);
+		old.swap(slots);
+		count = 0;
+		for (Symbol* s : old) {
+			if (s != nullptr) insert(s);
+		}
 	}
-	return objPtr;
+	insert(symbol);
+	return symbol;
 }
 
-bool isSymbolChar(const char c) {
-	return c != '(' && c != ')' && c != ' ' &&
-		c != '\t' && c != '\n' && c != '\r' && c != 0;
+void SymbolTable::trace() const {
+	for (Symbol* s : slots)
+		gc::mark(s);
 }
 
+void Proc::trace() const {
+	gc::mark(code);
+	gc::mark(env);
+}
 
-BObjSharedPtr readList(Env& env, std::istream& is) {
-	is >> std::ws;
-	if (is.eof()) 
-		throw "Parser contains errors";
-	char c = is.get();
-	if (c == ')') {
-		return registerSymbol("null");
-	}
-	else if (c == '.') {
-		BObjSharedPtr cdr = readParse(env, is);
-		is >> std::ws;
-		if (is.get() != ')') 
-			throw "Parser contains errors";
-		return cdr;
-	}
-	else {
-		is.unget();
-		BObjSharedPtr car = readParse(env, is);
-		BObjSharedPtr cdr = readList(env, is);
-		return BObjSharedPtr(new Cons(car, cdr));
-	}
+void Macro::trace() const {
+	gc::mark(code);
+	gc::mark(env);
 }
 
-BObjSharedPtr readString(Env& env, std::istream& is) {
-	char c = is.get();
-	std::stringstream ss;
-	while (c != '"') {
-		if (c == '\\') {
-			switch (c = is.get()) {
-			case 'n': c = '\n'; break;
-			case 'f': c = '\f'; break;
-			case 'b': c = '\b'; break;
-			case 'r': c = '\r'; break;
-			case 't': c = '\t'; break;
-			case '\'': c = '\''; break;
-			case '\"': c = '\"'; break;
-			case '\\': c = '\\'; break;
-			case '\n': case '\r': c = 0; break;
-			}
-		}
-		if (c != 0) {
-			ss << c;
-		}
-		if (is.eof())
-			throw "Parser contains errors";
-		c = is.get();
-	}
-	return BObjSharedPtr(new String(ss.str()));
+std::ostream& operator<<(std::ostream& os, const LObj& o) {
+	if (o.isFixnum())
+		return os << o.fixnumValue();
+	return o->operator<<(os);
 }
 
-void commentSkip(std::istream& is) {
-	is >> std::ws;
-	char c = is.peek();
-	while (c == ';') {
-		while (c != 0 && c != '\n' && c != '\r') c = is.get();
-		is >> std::ws;
-		c = is.peek();
-	}
+LObj registerSymbol(std::string_view name) {
+	return LObj(symbolTable().intern(name));
 }
 
-BObjSharedPtr readParse(Env& env, std::istream& is) {
-	commentSkip(is);
-	if (is.eof()) throw "Parser contains errors";
-	char c = is.get();
-	if (c == '(') {
-		return readList(env, is);
-	}
-	else if (('0' <= c && c <= '9') ||
-		(c == '-' && ('0' <= is.peek() && is.peek() <= '9'))) {
-		is.unget();
-		int value;
-		is >> value;
-		return BObjSharedPtr(new Integer(value));
-	}
-	else if (c == '"') {
-		return readString(env, is);
-	}
-	else {
-		char symbolName[512];
-		int i = 0;
-		while (isSymbolChar(c) && !is.eof()) {
-			symbolName[i++] = c;
-			c = is.get();
-		}
-		is.unget();
-		if (i == 0) throw "Parser contains errors";
-		symbolName[i] = 0;
-		return registerSymbol(symbolName);
-	}
+LObj Env::sharedGlobalValue(Symbol* symbol) const {
+	auto it = sharedGlobals.find(symbol);
+	return it != sharedGlobals.end() ? it->second.load(std::memory_order_acquire) : LObj();
 }
 
-BObjSharedPtr Env::read(std::istream& is) {
+LObj Env::read(std::istream& is) {
+	std::string text;
+	if (!readDatumText(is, text))
+		return LObj(nullptr);
 	try {
-		return readParse(*this, is);
+		return Reader(text).read();
 	}
 	catch (char const* e) {
-		return BObjSharedPtr(nullptr);
+		return LObj(nullptr);
+	}
+}
+
+void Env::run(std::istream& is) {
+	std::string text;
+	while (readDatumText(is, text)) {
+		if (evalTop(Reader(text).read()) == LObj(&Symbols::Exit))
+			break;
 	}
 }
 
-BObjSharedPtr listLastCdrObj(BObjSharedPtr objPtr) {
-	if (objPtr->typep<Cons>())
-		return listLastCdrObj(objPtr->getAs<Cons>().cdr);
+LObj listLastCdrObj(const LObj& objPtr) {
+	if (objPtr.typep<Cons>())
+		return listLastCdrObj(objPtr.getAs<Cons>().cdr);
 	return objPtr;
 }
 
-bool isProperList(Base_Object* obj) {
-	if (typeid(*obj) == typeid(Cons))
-		return isProperList(dynamic_cast<Cons*>(obj)->cdr.get());
-	if (typeid(*obj) == typeid(Symbol))
-		return dynamic_cast<Symbol*>(obj)->name == "null";
-	return false;
+bool isProperList(const LObj& obj) {
+	LObj o = obj;
+	while (o.typep<Cons>())
+		o = o.getAs<Cons>().cdr;
+	return o.isnull();
 }
 
-int listLength(Base_Object* obj) {
-	if (typeid(*obj) == typeid(Cons))
-		return 1 + listLength(dynamic_cast<Cons*>(obj)->cdr.get());
-	return 0;
+int listLength(const LObj& obj) {
+	int length = 0;
+	for (LObj o = obj; o.typep<Cons>(); o = o.getAs<Cons>().cdr)
+		++length;
+	return length;
 }
 
-BObjSharedPtr listNth(BObjSharedPtr& objptr, int i) {
-	if (typeid(*objptr) != typeid(Cons))
-		return BObjSharedPtr(nullptr);
+LObj listNth(const LObj& objptr, int i) {
+	if (!objptr.typep<Cons>())
+		return LObj(nullptr);
 	if (i == 0)
-		return dynamic_cast<Cons*>(objptr.get())->car;
-	return listNth(dynamic_cast<Cons*>(objptr.get())->cdr, i - 1);
+		return objptr.getAs<Cons>().car;
+	return listNth(objptr.getAs<Cons>().cdr, i - 1);
 }
 
-BObjSharedPtr listNthCdr(BObjSharedPtr& objptr, int i) {
+LObj listNthCdr(const LObj& objptr, int i) {
 	if (i == 0)
 		return objptr;
-	if (typeid(*objptr) != typeid(Cons))
-		return BObjSharedPtr(nullptr);
-	return listNthCdr(dynamic_cast<Cons*>(objptr.get())->cdr, i - 1);
+	if (!objptr.typep<Cons>())
+		return LObj(nullptr);
+	return listNthCdr(objptr.getAs<Cons>().cdr, i - 1);
 }
 
-BObjSharedPtr map(BObjSharedPtr objPtr, std::function<BObjSharedPtr(BObjSharedPtr)> func) {
-	if (typeid(*objPtr) != typeid(Cons))
-		return objPtr;
-	Cons* cons = dynamic_cast<Cons*>(objPtr.get());
-	return std::make_shared<Cons>(func(cons->car), map(cons->cdr, func));
-}
-
-BObjSharedPtr boolToLobj(bool b) {
-	return registerSymbol(b ? "t" : "f");
+LObj map(const LObj& objPtr, std::function<LObj(const LObj&)> func) {
+	LObj head;
+	LObj tail;
+	LObj o = objPtr;
+	for (; o.typep<Cons>(); o = o.getAs<Cons>().cdr) {
+		LObj cell = makeObj<Cons>(func(o.getAs<Cons>().car), LObj());
+		if (tail == nullptr)
+			head = cell;
+		else
+			tail.getAs<Cons>().cdr = cell;
+		tail = cell;
+	}
+	if (tail == nullptr)
+		return o;
+	tail.getAs<Cons>().cdr = o;
+	return head;
 }
 
-BObjSharedPtr evalListElements(EnvSPtr env, BObjSharedPtr objPtr) {
-	if (typeid(*objPtr) != typeid(Cons)) return objPtr;
-	Cons* cons = dynamic_cast<Cons*>(objPtr.get());
-	return std::make_shared<Cons>(env->eval(cons->car), evalListElements(env, cons->cdr));
+LObj boolToLobj(bool b) {
+	return LObj(b ? &Symbols::T : &Symbols::F);
 }
 
-BObjSharedPtr vectorToList(std::vector<BObjSharedPtr>& v) {
-	BObjSharedPtr list = registerSymbol("null");
+LObj vectorToList(std::vector<LObj>& v) {
+	LObj list = LObj(&Symbols::Null);
 	for (auto it = v.rbegin(); it != v.rend(); ++it) {
-		list = std::make_shared<Cons>(*it, list);
+		list = makeObj<Cons>(*it, list);
 	}
 	return list;
 }
 
-EnvSPtr makeEnvForMacro(EnvSPtr outEnvironment, EnvSPtr procEnv, BObjSharedPtr prms, BObjSharedPtr args, bool tail = false) {
-	EnvSPtr env = outEnvironment->createSubEnvironment(procEnv);
-	if (!isProperList(args.get()))
-		throw "Wrong usage of macro";
-	while (prms->typep<Cons>() && args->typep<Cons>()) {
-		Symbol* symbol = &prms->getAs<Cons>().car->getAs<Symbol>();
-		env->bind(args->getAs<Cons>().car, symbol);
-		prms = prms->getAs<Cons>().cdr;
-		args = args->getAs<Cons>().cdr;
-	}
-	if (typeid(*prms) == typeid(Symbol) && !prms->isnull()) {
-		env->bind(args, &prms->getAs<Symbol>());
-	}
-	if (tail && !outEnvironment->isClosed()) {
-		outEnvironment->merge(env);
-		env = outEnvironment;
-	}
-	return env;
-}
-
-EnvSPtr makeEnvForApply(EnvSPtr outEnvironment, EnvSPtr procEnv, BObjSharedPtr prms, BObjSharedPtr args, bool tail = false) {
-	EnvSPtr env = outEnvironment->createSubEnvironment(procEnv);
-	if (!isProperList(args.get()))
-		throw "Wrong usage";
-	while (prms->typep<Cons>() && args->typep<Cons>()) {
-		Symbol* symbol = &prms->getAs<Cons>().car->getAs<Symbol>();
-		env->bind(outEnvironment->eval(args->getAs<Cons>().car), symbol);
-		prms = prms->getAs<Cons>().cdr;
-		args = args->getAs<Cons>().cdr;
-	}
-	if (typeid(*prms) == typeid(Symbol) && !prms->isnull()) {
-		BObjSharedPtr rest = evalListElements(outEnvironment, args);
-		env->bind(rest, &prms->getAs<Symbol>());
-	}
-	if (tail && !outEnvironment->isClosed()) {
-		outEnvironment->merge(env);
-		env = outEnvironment;
+std::vector<LObj> listToVector(const LObj& list) {
+	std::vector<LObj> v;
+	for (LObj o = list; o.typep<Cons>(); o = o.getAs<Cons>().cdr)
+		v.push_back(o.getAs<Cons>().car);
+	return v;
+}
+
+namespace {
+	const char* const TypeNames[] = {
+		"empty", "fixnum", "symbol", "cons", "string", "bignum", "float", "vector",
+		"hash-table", "proc", "predefined-proc", "macro", "env", "code", "frame",
+		"const", "local-ref", "global-ref", "if", "seq", "define", "set", "let",
+		"lambda", "call", "future",
+	};
+	static_assert(std::size(TypeNames) == static_cast<size_t>(Type::Count));
+
+	std::vector<std::pair<const char*, size_t>> heapTotals() {
+		return {
+			{ "bytes-allocated", gc::bytesAllocated() },
+			{ "heap-bytes", gc::heapSize() },
+			{ "peak-heap-bytes", gc::peakHeapSize() },
+			{ "collections", gc::collections() },
+			{ "symbols", symbolTable().size() },
+			{ "peak-call-depth", Interpreter::current().machine.peakCallDepth() },
+		};
 	}
-	return env;
 }
 
+LObj heapStats() {
+	std::vector<LObj> entries;
+	gc::VectorRoot root(entries);
+	for (auto& [name, value] : heapTotals())
+		entries.push_back(makeObj<Cons>(registerSymbol(name), makeInteger(value)));
+	for (size_t i = 0; i < static_cast<size_t>(Type::Count); ++i) {
+		gc::TypeCounts counts = gc::typeCounts(static_cast<Type>(i));
+		if (counts.allocated == 0) continue;
+		LObj row = makeObj<Cons>(makeInteger(counts.allocated), LObj(&Symbols::Null));
+		row = makeObj<Cons>(makeInteger(counts.allocated - counts.freed), row);
+		entries.push_back(makeObj<Cons>(registerSymbol(TypeNames[i]), row));
+	}
+	return vectorToList(entries);
+}
 
-Env::Env() {
-	BObjSharedPtr obj;
-	PredefinedProc* bfunc;
+void printHeapStats(std::ostream& os) {
+	for (auto& [name, value] : heapTotals())
+		os << std::left << std::setw(18) << name << value << '\n';
+	os << std::left << std::setw(18) << "type" << std::right << std::setw(12) << "live" << std::setw(14) << "allocated" << '\n';
+	for (size_t i = 0; i < static_cast<size_t>(Type::Count); ++i) {
+		const gc::TypeCounts& counts = gc::typeCounts(static_cast<Type>(i));
+		if (counts.allocated == 0) continue;
+		os << std::left << std::setw(18) << TypeNames[i] << std::right << std::setw(12) << counts.allocated - counts.freed
+			<< std::setw(14) << counts.allocated << '\n';
+	}
+	os << std::left;
+}
 
-	obj = registerSymbol("t");
-	bind(obj, &obj->getAs<Symbol>());
+Env::Env()
+	: Base_Object(TypeTag) {
+	LObj obj;
+	PredefinedProc* bfunc;
 
-	obj = registerSymbol("null");
-	bind(obj, &obj->getAs<Symbol>());
+	for (Symbol* s : StaticSymbols) {
+		if (s->value.load(std::memory_order_relaxed) == nullptr)
+			sharedGlobals[s];
+	}
+	globals.push_back(&Symbols::T);
+	globals.push_back(&Symbols::Null);
 
 	obj = registerSymbol("eq?");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() == 0) throw "Invalid arguments of function 'eq?'";
-		for (int i = 0; i < args.size() - 1; ++i) {
-			if (!(args[i].get() == args[i + 1].get()))
-				return registerSymbol("f");
+	bfunc = gcNew<PredefinedProc>("eq?", 1, PredefinedProc::Variadic, [](Env&, std::span<LObj> args) {
+		for (size_t i = 0; i + 1 < args.size(); ++i) {
+			if (!(args[i] == args[i + 1]))
+				return LObj(&Symbols::F);
 		}
-		return registerSymbol("t");
+		return LObj(&Symbols::T);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("null?");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 1) throw "Invalid arguments of function 'null'";
-		return boolToLobj(args[0]->isnull());
+	bfunc = gcNew<PredefinedProc>("null?", [](Env&, LObj a) {
+		return boolToLobj(a.isnull());
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("cons?");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 1) throw "Invalid arguments of function 'null'";
-		return boolToLobj(typeid(*args[0]) == typeid(Cons));
+	bfunc = gcNew<PredefinedProc>("cons?", [](Env&, LObj a) {
+		return boolToLobj(a.type() == Type::Cons);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("list?");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 1) throw "Invalid arguments of function 'null'";
-		return boolToLobj(typeid(*args[0]) == typeid(Cons) || args[0]->isnull());
+	bfunc = gcNew<PredefinedProc>("list?", [](Env&, LObj a) {
+		return boolToLobj(a.type() == Type::Cons || a.isnull());
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("symbol?");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 1) throw "Invalid arguments of function 'null'";
-		return boolToLobj(typeid(*args[0]) == typeid(Symbol));
+	bfunc = gcNew<PredefinedProc>("symbol?", [](Env&, LObj a) {
+		return boolToLobj(a.type() == Type::Symbol);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("int?");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 1) throw "Invalid arguments of function 'null'";
-		return boolToLobj(typeid(*args[0]) == typeid(Integer));
+	bfunc = gcNew<PredefinedProc>("int?", [](Env&, LObj a) {
+		Type type = a.type();
+		return boolToLobj(type == Type::Fixnum || type == Type::Bignum);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("string?");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 1) throw "Invalid arguments of function 'null'";
-		return boolToLobj(typeid(*args[0]) == typeid(String));
+	bfunc = gcNew<PredefinedProc>("string?", [](Env&, LObj a) {
+		return boolToLobj(a.type() == Type::String);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("proc?");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 1) throw "Invalid arguments of function 'null'";
-		return boolToLobj(typeid(*args[0]) == typeid(Proc) ||
-			typeid(*args[0]) == typeid(PredefinedProc));
+	bfunc = gcNew<PredefinedProc>("proc?", [](Env&, LObj a) {
+		Type type = a.type();
+		return boolToLobj(type == Type::Proc || type == Type::PredefinedProc);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("float?");
+	bfunc = gcNew<PredefinedProc>("float?", [](Env&, LObj a) {
+		return boolToLobj(a.type() == Type::Float);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("number?");
+	bfunc = gcNew<PredefinedProc>("number?", [](Env&, LObj a) {
+		return boolToLobj(isNumber(a));
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("+");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		int value = 0;
-		for (BObjSharedPtr& objPtr : args) {
-			if (typeid(*objPtr) != typeid(Integer)) throw "Invalid arguments of function '+'";
-			value += dynamic_cast<Integer*>(objPtr.get())->value;
+	bfunc = gcNew<PredefinedProc>("+", 0, PredefinedProc::Variadic, [](Env&, std::span<LObj> args) {
+		LObj value = LObj::fixnum(0);
+		for (LObj& objPtr : args) {
+			if (!isNumber(objPtr)) throw "Invalid arguments of function '+'";
+			value = numberAdd(value, objPtr);
 		}
-		return std::make_shared<Integer>(value);
+		return value;
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("-");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() == 0 || typeid(*args[0]) != typeid(Integer))
+	bfunc = gcNew<PredefinedProc>("-", 1, PredefinedProc::Variadic, [](Env&, std::span<LObj> args) {
+		if (!isNumber(args[0]))
 			throw "Invalid arguments of function '-'";
-		int value = dynamic_cast<Integer*>(args[0].get())->value;
 		if (args.size() == 1)
-			return std::make_shared<Integer>(-value);
-		for (int i = 1; i < args.size(); ++i) {
-			if (typeid(*args[i]) != typeid(Integer)) throw "Invalid arguments of function '-'";
-			value -= dynamic_cast<Integer*>(args[i].get())->value;
+			return numberSub(LObj::fixnum(0), args[0]);
+		LObj value = args[0];
+		for (size_t i = 1; i < args.size(); ++i) {
+			if (!isNumber(args[i])) throw "Invalid arguments of function '-'";
+			value = numberSub(value, args[i]);
 		}
-		return std::make_shared<Integer>(value);
+		return value;
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("*");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		int value = 1;
-		for (BObjSharedPtr& objPtr : args) {
-			if (typeid(*objPtr) != typeid(Integer)) throw "Invalid arguments of function '*'";
-			value *= dynamic_cast<Integer*>(objPtr.get())->value;
+	bfunc = gcNew<PredefinedProc>("*", 0, PredefinedProc::Variadic, [](Env&, std::span<LObj> args) {
+		LObj value = LObj::fixnum(1);
+		for (LObj& objPtr : args) {
+			if (!isNumber(objPtr)) throw "Invalid arguments of function '*'";
+			value = numberMul(value, objPtr);
 		}
-		return std::make_shared<Integer>(value);
+		return value;
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("/");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() == 0 || typeid(*args[0]) != typeid(Integer))
+	bfunc = gcNew<PredefinedProc>("/", 1, PredefinedProc::Variadic, [](Env&, std::span<LObj> args) {
+		if (!isNumber(args[0]))
 			throw "Invalid arguments of function '/'";
-		int value = dynamic_cast<Integer*>(args[0].get())->value;
-		for (int i = 1; i < args.size(); ++i) {
-			if (typeid(*args[i]) != typeid(Integer)) throw "Invalid arguments of function '/'";
-			int divisor = dynamic_cast<Integer*>(args[i].get())->value;
-			if (divisor == 0) throw "dividing by zero";
-			value /= divisor;
+		LObj value = args[0];
+		for (size_t i = 1; i < args.size(); ++i) {
+			if (!isNumber(args[i])) throw "Invalid arguments of function '/'";
+			value = numberDiv(value, args[i]);
 		}
-		return std::make_shared<Integer>(value);
+		return value;
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("mod");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 2 ||
-			typeid(*args[0]) != typeid(Integer) || typeid(*args[1]) != typeid(Integer))
+	bfunc = gcNew<PredefinedProc>("mod", [](Env&, LObj a, LObj b) {
+		if (!isNumber(a) || !isNumber(b))
 			throw "Invalid arguments of function 'mod'";
-		int value = dynamic_cast<Integer*>(args[0].get())->value;
-		int divisor = dynamic_cast<Integer*>(args[1].get())->value;
-		if (divisor == 0) throw "dividing by zero";
-		return std::make_shared<Integer>(value % divisor);
+		return numberMod(a, b);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("=");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() == 0) throw "Invalid arguments of function '='";
-		for (BObjSharedPtr& objPtr : args) {
-			if (typeid(*objPtr) != typeid(Integer)) throw "Invalid arguments of function '='";
+	bfunc = gcNew<PredefinedProc>("=", 1, PredefinedProc::Variadic, [](Env&, std::span<LObj> args) {
+		for (LObj& objPtr : args) {
+			if (!isNumber(objPtr)) throw "Invalid arguments of function '='";
 		}
-		for (int i = 0; i < args.size() - 1; ++i) {
-			if (dynamic_cast<Integer*>(args[i].get())->value !=
-				dynamic_cast<Integer*>(args[i + 1].get())->value)
-				return registerSymbol("null");
+		for (size_t i = 0; i + 1 < args.size(); ++i) {
+			if (numberCompare(args[i], args[i + 1]) != 0)
+				return LObj(&Symbols::Null);
 		}
-		return registerSymbol("t");
+		return LObj(&Symbols::T);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("<");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() == 0) throw "Invalid arguments of function '<'";
-		for (BObjSharedPtr& objPtr : args) {
-			if (typeid(*objPtr) != typeid(Integer)) throw "Invalid arguments of function '<'";
+	bfunc = gcNew<PredefinedProc>("<", 1, PredefinedProc::Variadic, [](Env&, std::span<LObj> args) {
+		for (LObj& objPtr : args) {
+			if (!isNumber(objPtr)) throw "Invalid arguments of function '<'";
 		}
-		for (int i = 0; i < args.size() - 1; ++i) {
-			if (dynamic_cast<Integer*>(args[i].get())->value >=
-				dynamic_cast<Integer*>(args[i + 1].get())->value)
-				return registerSymbol("null");
+		for (size_t i = 0; i + 1 < args.size(); ++i) {
+			if (numberCompare(args[i], args[i + 1]) >= 0)
+				return LObj(&Symbols::Null);
 		}
-		return registerSymbol("t");
+		return LObj(&Symbols::T);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("print");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		for (BObjSharedPtr& objPtr : args) {
-			objPtr->operator<<(std::cout);
+	bfunc = gcNew<PredefinedProc>("print", 0, PredefinedProc::Variadic, [](Env&, std::span<LObj> args) {
+		for (LObj& objPtr : args) {
+			std::cout << objPtr;
 		}
-		return registerSymbol("null");
+		return LObj(&Symbols::Null);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("println");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		for (BObjSharedPtr& objPtr : args) {
-			objPtr->operator<<(std::cout);
-			std::cout << std::endl;
+	bfunc = gcNew<PredefinedProc>("println", 0, PredefinedProc::Variadic, [](Env&, std::span<LObj> args) {
+		for (LObj& objPtr : args) {
+			std::cout << objPtr;
+			std::cout << '\n';
 		}
-		return registerSymbol("null");
+		return LObj(&Symbols::Null);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	// Output is buffered and otherwise only written out at exit.
+	obj = registerSymbol("flush");
+	bfunc = gcNew<PredefinedProc>("flush", [](Env&) {
+		std::cout.flush();
+		return LObj(&Symbols::Null);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("print-to-string");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
+	bfunc = gcNew<PredefinedProc>("print-to-string", 0, PredefinedProc::Variadic, [](Env&, std::span<LObj> args) {
 		std::stringstream ss;
-		for (BObjSharedPtr& objPtr : args) {
-			objPtr->operator<<(ss);
+		for (LObj& objPtr : args) {
+			ss << objPtr;
 		}
-		return std::make_shared<String>(ss.str());
+		return makeObj<String>(ss.str());
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("car");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 1 || typeid(*args[0]) != typeid(Cons))
+	bfunc = gcNew<PredefinedProc>("car", [](Env&, LObj a) {
+		if (!a.typep<Cons>())
 			throw "Invalid arguments of function 'car'";
-		return dynamic_cast<Cons*>(args[0].get())->car;
+		return a.getAs<Cons>().car;
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("cdr");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 1 || typeid(*args[0]) != typeid(Cons))
+	bfunc = gcNew<PredefinedProc>("cdr", [](Env&, LObj a) {
+		if (!a.typep<Cons>())
 			throw "Invalid arguments of function 'cdr'";
-		return dynamic_cast<Cons*>(args[0].get())->cdr;
+		return a.getAs<Cons>().cdr;
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("cons");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 2)
-			throw "Invalid arguments of function 'cons'";
-		return std::make_shared<Cons>(args[0], args[1]);
+	bfunc = gcNew<PredefinedProc>("cons", [](Env&, LObj a, LObj d) {
+		return makeObj<Cons>(a, d);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("vector?");
+	bfunc = gcNew<PredefinedProc>("vector?", [](Env&, LObj a) {
+		return boolToLobj(a.type() == Type::Vector);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("vector");
+	bfunc = gcNew<PredefinedProc>("vector", 0, PredefinedProc::Variadic, [](Env&, std::span<LObj> args) {
+		return makeObj<Vector>(std::vector<LObj>(args.begin(), args.end()));
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("make-vector");
+	bfunc = gcNew<PredefinedProc>("make-vector", 1, 2, [](Env&, std::span<LObj> args) {
+		if (!args[0].isFixnum() || args[0].fixnumValue() < 0 ||
+			static_cast<size_t>(args[0].fixnumValue()) > Vector::MaxLength)
+			throw "Invalid arguments of function 'make-vector'";
+		LObj fill = args.size() == 2 ? args[1] : LObj(&Symbols::Null);
+		try {
+			return makeObj<Vector>(std::vector<LObj>(args[0].fixnumValue(), fill));
+		}
+		catch (const std::bad_alloc&) {
+			throw "Not enough memory for function 'make-vector'";
+		}
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("vector-length");
+	bfunc = gcNew<PredefinedProc>("vector-length", [](Env&, LObj v) {
+		if (!v.typep<Vector>())
+			throw "Invalid arguments of function 'vector-length'";
+		return LObj::fixnum(v.getAs<Vector>().values.size());
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("vector-ref");
+	bfunc = gcNew<PredefinedProc>("vector-ref", [](Env&, LObj v, LObj index) {
+		if (!v.typep<Vector>() || !index.isFixnum())
+			throw "Invalid arguments of function 'vector-ref'";
+		std::vector<LObj>& values = v.getAs<Vector>().values;
+		intptr_t i = index.fixnumValue();
+		if (i < 0 || i >= static_cast<intptr_t>(values.size()))
+			throw "Index out of range in function 'vector-ref'";
+		return values[i];
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("vector-set!");
+	bfunc = gcNew<PredefinedProc>("vector-set!", [](Env&, LObj v, LObj index, LObj value) {
+		if (!v.typep<Vector>() || !index.isFixnum())
+			throw "Invalid arguments of function 'vector-set!'";
+		std::vector<LObj>& values = v.getAs<Vector>().values;
+		intptr_t i = index.fixnumValue();
+		if (i < 0 || i >= static_cast<intptr_t>(values.size()))
+			throw "Index out of range in function 'vector-set!'";
+		if (!gc::isLocal(v.get()))
+			throw "Cannot modify shared data inside a parallel task";
+		waitForTasks();
+		values[i] = value;
+		return value;
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("vector->list");
+	bfunc = gcNew<PredefinedProc>("vector->list", [](Env&, LObj v) {
+		if (!v.typep<Vector>())
+			throw "Invalid arguments of function 'vector->list'";
+		return vectorToList(v.getAs<Vector>().values);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("list->vector");
+	bfunc = gcNew<PredefinedProc>("list->vector", [](Env&, LObj list) {
+		if (!isProperList(list))
+			throw "Invalid arguments of function 'list->vector'";
+		return makeObj<Vector>(listToVector(list));
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("equal?");
+	bfunc = gcNew<PredefinedProc>("equal?", [](Env&, LObj a, LObj b) {
+		return boolToLobj(equal(a, b));
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("hash-table?");
+	bfunc = gcNew<PredefinedProc>("hash-table?", [](Env&, LObj a) {
+		return boolToLobj(a.type() == Type::HashTable);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("make-hash-table");
+	bfunc = gcNew<PredefinedProc>("make-hash-table", 0, 1, [](Env&, std::span<LObj> args) {
+		if (args.size() == 1 && (!args[0].isFixnum() || args[0].fixnumValue() < 0 ||
+			static_cast<size_t>(args[0].fixnumValue()) > HashTable::MaxCapacity))
+			throw "Invalid arguments of function 'make-hash-table'";
+		try {
+			return makeObj<HashTable>(args.size() == 1 ? args[0].fixnumValue() : 0);
+		}
+		catch (const std::bad_alloc&) {
+			throw "Not enough memory for function 'make-hash-table'";
+		}
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("hash-ref");
+	bfunc = gcNew<PredefinedProc>("hash-ref", 2, 3, [](Env&, std::span<LObj> args) {
+		if (!args[0].typep<HashTable>())
+			throw "Invalid arguments of function 'hash-ref'";
+		LObj* value = args[0].getAs<HashTable>().lookup(args[1]);
+		if (value != nullptr)
+			return *value;
+		return args.size() == 3 ? args[2] : LObj(&Symbols::Null);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("hash-set!");
+	bfunc = gcNew<PredefinedProc>("hash-set!", [](Env&, LObj table, LObj key, LObj value) {
+		if (!table.typep<HashTable>())
+			throw "Invalid arguments of function 'hash-set!'";
+		if (!gc::isLocal(table.get()))
+			throw "Cannot modify shared data inside a parallel task";
+		waitForTasks();
+		table.getAs<HashTable>().set(key, value);
+		return value;
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("hash-remove!");
+	bfunc = gcNew<PredefinedProc>("hash-remove!", [](Env&, LObj table, LObj key) {
+		if (!table.typep<HashTable>())
+			throw "Invalid arguments of function 'hash-remove!'";
+		if (!gc::isLocal(table.get()))
+			throw "Cannot modify shared data inside a parallel task";
+		waitForTasks();
+		return boolToLobj(table.getAs<HashTable>().remove(key));
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("hash-count");
+	bfunc = gcNew<PredefinedProc>("hash-count", [](Env&, LObj table) {
+		if (!table.typep<HashTable>())
+			throw "Invalid arguments of function 'hash-count'";
+		return LObj::fixnum(table.getAs<HashTable>().size());
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("hash-keys");
+	bfunc = gcNew<PredefinedProc>("hash-keys", [](Env&, LObj table) {
+		if (!table.typep<HashTable>())
+			throw "Invalid arguments of function 'hash-keys'";
+		std::vector<LObj> keys;
+		table.getAs<HashTable>().forEach([&](const LObj& k, const LObj&) { keys.push_back(k); });
+		return vectorToList(keys);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("hash-values");
+	bfunc = gcNew<PredefinedProc>("hash-values", [](Env&, LObj table) {
+		if (!table.typep<HashTable>())
+			throw "Invalid arguments of function 'hash-values'";
+		std::vector<LObj> values;
+		table.getAs<HashTable>().forEach([&](const LObj&, const LObj& v) { values.push_back(v); });
+		return vectorToList(values);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("hash->list");
+	bfunc = gcNew<PredefinedProc>("hash->list", [](Env&, LObj table) {
+		if (!table.typep<HashTable>())
+			throw "Invalid arguments of function 'hash->list'";
+		std::vector<LObj> pairs;
+		gc::VectorRoot root(pairs);
+		table.getAs<HashTable>().forEach([&](const LObj& k, const LObj& v) {
+			pairs.push_back(makeObj<Cons>(k, v));
+			});
+		return vectorToList(pairs);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	// The entries are copied out first so that fn may modify the table.
+	obj = registerSymbol("hash-for-each");
+	bfunc = gcNew<PredefinedProc>("hash-for-each", [](Env& env, LObj table, LObj fn) {
+		if (!table.typep<HashTable>())
+			throw "Invalid arguments of function 'hash-for-each'";
+		std::vector<LObj> entries;
+		gc::VectorRoot root(entries);
+		table.getAs<HashTable>().forEach([&](const LObj& k, const LObj& v) {
+			entries.push_back(k);
+			entries.push_back(v);
+			});
+		for (size_t i = 0; i < entries.size(); i += 2)
+			Interpreter::current().machine.apply(fn, { entries[i], entries[i + 1] }, &env);
+		return LObj(&Symbols::Null);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("gensym");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
+	bfunc = gcNew<PredefinedProc>("gensym", 0, 1, [](Env&, std::span<LObj> args) {
 		std::stringstream ss;
 		if (args.size() == 0) {
-			ss << "#g" << (totalSym++);
+			ss << "#g" << (Interpreter::current().gensymCounter++);
 		}
-		else if (args.size() == 1 && typeid(*args[0]) == typeid(String)) {
-			ss << "#" << (static_cast<String*>(args[0].get())->value) << (totalSym++);
+		else if (args[0].typep<String>()) {
+			ss << "#" << (args[0].getAs<String>().value) << (Interpreter::current().gensymCounter++);
 		}
 		else {
 			throw "Invalid arguments of function 'gensym'";
 		}
-		return std::make_shared<Symbol>(ss.str());
+		return makeObj<Symbol>(ss.str());
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("bound?");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 1 || !args[0]->typep<Symbol>())
+	bfunc = gcNew<PredefinedProc>("bound?", [](Env& env, LObj symbol) {
+		if (!symbol.typep<Symbol>())
 			throw "Invalid arguments of function 'bound?'";
-		return boolToLobj(env.findSymbolInMap(&args[0]->getAs<Symbol>()) != nullptr);
+		return boolToLobj(env.findSymbolInMap(&symbol.getAs<Symbol>()) != nullptr);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("get-time");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 0)
-			throw "Invalid arguments of function 'get-time'";
-		return std::make_shared<Integer>(static_cast<int>(std::clock() / (CLOCKS_PER_SEC / 1000)));
+	bfunc = gcNew<PredefinedProc>("get-time", [](Env&) {
+		return makeInteger(static_cast<int64_t>(std::clock()) * 1000 / CLOCKS_PER_SEC);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("eval");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 1)
-			throw "Invalid arguments of function 'eval'";
-		return env.evalTop(args[0]);
+	bfunc = gcNew<PredefinedProc>("eval", [](Env& env, LObj form) {
+		return env.evalTop(form);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("read");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 0)
-			throw "Invalid arguments of function 'read'";
+	bfunc = gcNew<PredefinedProc>("read", [](Env& env) {
 		return env.read(std::cin);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("load");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 1 || typeid(*args[0]) != typeid(String))
+	bfunc = gcNew<PredefinedProc>("load", [](Env& env, LObj path) {
+		if (!path.typep<String>())
 			throw "Invalid arguments of function 'load'";
-		std::string filename = dynamic_cast<String*>(args[0].get())->value;
-		std::ifstream ifs(filename);
-		if (ifs.fail()) return registerSymbol("null");
+		const std::string& source = path.getAs<String>().value;
+		std::string file = source;
 		try {
-			while (!ifs.eof()) {
-				BObjSharedPtr o = env.read(ifs);
-				env.evalTop(o);
-				commentSkip(ifs);
+			if (hasCurrentCompiled(source)) {
+				file = compiledPath(source);
+				loadCompiled(file, env);
+				return LObj(&Symbols::T);
 			}
+			MappedFile file(source);
+			if (!file.isOpen()) return LObj(&Symbols::Null);
+			Reader reader(file.view());
+			while (!reader.atEnd())
+				env.evalTop(reader.read());
 		}
 		catch (char const* e) {
-			std::cout << std::endl << "Parser contains errors." << std::endl;
-			return registerSymbol("null");
+			std::cout.flush();
+			std::cerr << "Error in " << file << ": " << e << std::endl;
+			return LObj(&Symbols::Null);
 		}
-		return registerSymbol("t");
+		return LObj(&Symbols::T);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("save-image");
+	bfunc = gcNew<PredefinedProc>("save-image", [](Env&, LObj path) {
+		if (!path.typep<String>())
+			throw "Invalid arguments of function 'save-image'";
+		saveImage(path.getAs<String>().value);
+		return LObj(&Symbols::T);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("compile-file");
+	bfunc = gcNew<PredefinedProc>("compile-file", [](Env& env, LObj path) {
+		if (!path.typep<String>())
+			throw "Invalid arguments of function 'compile-file'";
+		compileFile(path.getAs<String>().value, env);
+		return LObj(&Symbols::T);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("macroexpand-all");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 1)
-			throw "Invalid arguments of function 'macroexpand-all'";
-		return env.macroExpand(args[0]);
+	bfunc = gcNew<PredefinedProc>("macroexpand-all", [](Env& env, LObj form) {
+		return env.macroExpand(form);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("disassemble");
+	bfunc = gcNew<PredefinedProc>("disassemble", [](Env&, LObj fn) {
+		if (fn.typep<Proc>())
+			fn.getAs<Proc>().code->disassemble(std::cout);
+		else if (fn.typep<Macro>())
+			fn.getAs<Macro>().code->disassemble(std::cout);
+		else
+			throw "Invalid arguments of function 'disassemble'";
+		return LObj(&Symbols::Null);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("profile-start");
+	bfunc = gcNew<PredefinedProc>("profile-start", [](Env&) {
+		if constexpr (!Profiling)
+			throw "Profiling is disabled in this build";
+		Interpreter::current().profiler.start();
+		return LObj(&Symbols::T);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("profile-stop");
+	bfunc = gcNew<PredefinedProc>("profile-stop", [](Env&) {
+		if constexpr (!Profiling)
+			throw "Profiling is disabled in this build";
+		Interpreter::current().profiler.stop();
+		return LObj(&Symbols::T);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	// Prints the table and, given a path, also writes collapsed stacks there.
+	obj = registerSymbol("profile-report");
+	bfunc = gcNew<PredefinedProc>("profile-report", 0, 1, [](Env&, std::span<LObj> args) {
+		if (args.size() == 1 && !args[0].typep<String>())
+			throw "Invalid arguments of function 'profile-report'";
+		if constexpr (!Profiling)
+			throw "Profiling is disabled in this build";
+		Interpreter::current().profiler.report(std::cout);
+		if (args.size() == 1) {
+			std::ofstream out(args[0].getAs<String>().value);
+			if (!out)
+				throw "Cannot open profile output file";
+			Interpreter::current().profiler.writeCollapsedStacks(out);
+		}
+		return LObj(&Symbols::Null);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
-	obj = registerSymbol("exit");
-	bind(obj, &obj->getAs<Symbol>());
+	obj = registerSymbol("heap-stats");
+	bfunc = gcNew<PredefinedProc>("heap-stats", [](Env&) {
+		return heapStats();
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("pmap");
+	bfunc = gcNew<PredefinedProc>("pmap", [](Env&, LObj fn, LObj list) {
+		if (!isProperList(list))
+			throw "Invalid arguments of function 'pmap'";
+		return parallelMap(fn, list);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	obj = registerSymbol("parallel-reduce");
+	bfunc = gcNew<PredefinedProc>("parallel-reduce", [](Env&, LObj fn, LObj init, LObj list) {
+		if (!isProperList(list))
+			throw "Invalid arguments of function 'parallel-reduce'";
+		return parallelReduce(fn, init, list);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	// (future expr) is analyzed into a call of this with (lambda () expr).
+	bfunc = gcNew<PredefinedProc>("future", [](Env&, LObj thunk) {
+		return spawnFuture(thunk);
+		});
+	bind(LObj(bfunc), &Symbols::Future);
+
+	obj = registerSymbol("touch");
+	bfunc = gcNew<PredefinedProc>("touch", [](Env&, LObj future) {
+		if (!future.typep<Future>())
+			throw "Invalid arguments of function 'touch'";
+		return touchFuture(future.getAs<Future>());
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	globals.push_back(&Symbols::Exit);
 
 	obj = registerSymbol("env-print");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 0)
-			throw "Invalid arguments of function 'env-print'";
+	bfunc = gcNew<PredefinedProc>("env-print", [](Env& env) {
 		env.print();
-		std::cout << std::endl;
-		return registerSymbol("null");
+		std::cout << '\n';
+		return LObj(&Symbols::Null);
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
 
 	obj = registerSymbol("env-print-all");
-	bfunc = new PredefinedProc([](Env& env, std::vector<BObjSharedPtr>& args) {
-		if (args.size() != 0)
-			throw "Invalid arguments of function 'env-print-all'";
+	bfunc = gcNew<PredefinedProc>("env-print-all", [](Env& env) {
 		env.printAll(true);
-		std::cout << std::endl;
-		return registerSymbol("null");
+		std::cout << '\n';
+		return LObj(&Symbols::Null);
+		});
+	bind(LObj(bfunc), &obj.getAs<Symbol>());
+
+	forEachGlobal([this](Symbol*, LObj value) {
+		if (value.typep<PredefinedProc>())
+			builtins.push_back(&value.getAs<PredefinedProc>());
 		});
-	bind(BObjSharedPtr(bfunc), &obj->getAs<Symbol>());
 }
 
-BObjSharedPtr Env::macroExpand(BObjSharedPtr objPtr) {
-	if (!objPtr->typep<Cons>())
+// Expansions are copy-on-write: a list is rebuilt only up to its last
+// element that changed, and the rest of the source is shared.
+LObj Env::expandTree(LObj objPtr) {
+	if (!objPtr.typep<Cons>())
 		return objPtr;
-	Cons* cons = &objPtr->getAs<Cons>();
-	if (cons->car->typep<Symbol>()) {
-		Symbol* opSymbol = &cons->car->getAs<Symbol>();
-		if (opSymbol->name == "quote") {
+	Cons* cons = &objPtr.getAs<Cons>();
+	if (cons->car.typep<Symbol>()) {
+		Symbol* opSymbol = &cons->car.getAs<Symbol>();
+		if (opSymbol == &Symbols::Quote) {
 			return objPtr;
 		}
-		BObjSharedPtr op = findSymbolInMap(opSymbol);
-		if (op != nullptr && op->typep<Macro>()) {
-			Macro* macro = &op->getAs<Macro>();
-			EnvSPtr env = makeEnvForMacro(EnvSPtr(envobj), macro->env,
-				macro->parameterList, cons->cdr);
-			return macroExpand(env->eval(macro->body));
-		}
-	}
-	return map(objPtr, [this](BObjSharedPtr objPtr) {
-		return this->macroExpand(objPtr);
-		});
+		LObj op = findSymbolInMap(opSymbol);
+		if (op != nullptr && op.typep<Macro>()) {
+			LObj cached = macroCache().find(cons);
+			if (cached != nullptr)
+				return cached;
+			if (!isProperList(cons->cdr))
+				throw "Wrong usage of macro";
+			std::vector<LObj> args;
+			gc::VectorRoot root(args);
+			for (LObj a = cons->cdr; a.typep<Cons>(); a = a.getAs<Cons>().cdr)
+				args.push_back(a.getAs<Cons>().car);
+			LObj expanded = expandTree(Interpreter::current().machine.expand(&op.getAs<Macro>(), args, this));
+			macroCache().insert(cons, expanded);
+			return expanded;
+		}
+	}
+
+	std::vector<LObj> elements;
+	gc::VectorRoot root(elements);
+	size_t changed = 0;
+	for (LObj o = objPtr; o.typep<Cons>(); o = o.getAs<Cons>().cdr) {
+		LObj car = o.getAs<Cons>().car;
+		elements.push_back(expandTree(car));
+		if (elements.back() != car)
+			changed = elements.size();
+	}
+	if (changed == 0)
+		return objPtr;
+	LObj tail = objPtr;
+	for (size_t i = 0; i < changed; ++i)
+		tail = tail.getAs<Cons>().cdr;
+	for (size_t i = changed; i-- > 0;)
+		tail = makeObj<Cons>(elements[i], tail);
+	return tail;
 }
 
-BObjSharedPtr Env::procSpecialForm(BObjSharedPtr objPtr, bool tail) {
-	Cons* cons = &objPtr->getAs<Cons>();
-	Base_Object* op = cons->car.get();
-	if (!op->typep<Symbol>())
-		return BObjSharedPtr(nullptr);
+LObj Env::macroExpand(LObj objPtr) {
+	if (!objPtr.typep<Cons>())
+		return objPtr;
+	const Cons* form = &objPtr.getAs<Cons>();
+	LObj cached = macroCache().find(form);
+	if (cached != nullptr)
+		return cached;
+	LObj expanded = expandTree(objPtr);
+	macroCache().insert(form, expanded);
+	return expanded;
+}
 
-	int length = listLength(cons);
-	std::string operand = op->getAs<Symbol>().name;
-	if (operand == "if") {
-		if (length == 3 || length == 4) {
-			BObjSharedPtr cond = listNth(objPtr, 1);
-			if (!eval(cond)->isnull()) {
-				return eval(listNth(objPtr, 2), tail);
-			}
-			else if (length == 4) {
-				return eval(listNth(objPtr, 3), tail);
-			}
-			else {
-				return registerSymbol("null");
-			}
-		}
-	}
-	else if (operand == "quote") {
-		if (length == 2)
-			return listNth(objPtr, 1);
-	}
-	else if (operand == "do") {
-		if (length == 1)
-			return registerSymbol("null");
-		cons = &cons->cdr->getAs<Cons>();
-		while (cons->cdr->typep<Cons>()) {
-			eval(cons->car);
-			cons = &cons->cdr->getAs<Cons>();
-		}
-		return eval(cons->car, tail);
-	}
-	else if (operand == "define") {
-		if (length == 3) {
-			BObjSharedPtr variable = listNth(objPtr, 1);
-			if (typeid(*variable) != typeid(Symbol))
-				throw "Wrong 'define'";
-			Symbol* symbol = dynamic_cast<Symbol*>(variable.get());
-			EnvSPtr env = Environment;
-			env->bind(eval(listNth(objPtr, 2), tail), symbol);
-			return variable;
-		}
-	}
-	else if (operand == "set!") {
-		if (length == 3) {
-			BObjSharedPtr variable = listNth(objPtr, 1);
-			if (typeid(*variable) != typeid(Symbol))
-				throw "Wrong 'set!'";
-			Symbol* symbol = dynamic_cast<Symbol*>(variable.get());
-			EnvSPtr env = findEnvironment(symbol);
-			if (env == nullptr) env = Environment;
-			BObjSharedPtr value = eval(listNth(objPtr, 2), tail);
-			env->bind(value, symbol);
-			return value;
-		}
-	}
-	else if (operand == "let") {
-		if (length < 2) throw "Wrong usage";
-		BObjSharedPtr bindings = listNth(objPtr, 1);
-		if (!isProperList(bindings.get())) 
-			throw "Wrong let bindings";
-		if (listLength(bindings.get()) % 2 != 0) 
-			throw "Odd number of let bindings";
-		EnvSPtr env = createSubEnvironment();
-		while (!bindings->isnull()) {
-			BObjSharedPtr objSymbol = dynamic_cast<Cons*>(bindings.get())->car;
-			BObjSharedPtr objForm = dynamic_cast<Cons*>(dynamic_cast<Cons*>(bindings.get())->cdr.get())->car;
-			env->bind(eval(objForm), &objSymbol->getAs<Symbol>());
-			bindings = listNthCdr(bindings, 2);
-		}
-		if (tail && !closed) {
-			this->merge(env);
-			env = EnvSPtr(envobj);
-		}
-		return env->eval(std::make_shared<Cons>(registerSymbol("do"), listNthCdr(objPtr, 2)), TailCallOptimisation);
-	}
-	else if (operand == "let*") {
-		if (length < 2) throw 
-			"Wrong 'let*'";
-
-		BObjSharedPtr bindings = listNth(objPtr, 1);
-		if (!isProperList(bindings.get())) throw 
-			"bad let* bindings";
-		if (listLength(bindings.get()) % 2 != 0) throw 
-			"number of bindings elements of let* is odd";
-		EnvSPtr env;
-		if (tail && !closed) {
-			env = EnvSPtr(envobj);
-		}
-		else {
-			env = createSubEnvironment();
-		}
-		while (!bindings->isnull()) {
-			BObjSharedPtr objSymbol = dynamic_cast<Cons*>(bindings.get())->car;
-			BObjSharedPtr objForm = dynamic_cast<Cons*>(dynamic_cast<Cons*>(bindings.get())->cdr.get())->car;
-			Symbol* symbol = dynamic_cast<Symbol*>(objSymbol.get());
-			env->bind(env->eval(objForm), symbol);
-			bindings = listNthCdr(bindings, 2);
-		}
-		return env->eval(std::make_shared<Cons>(registerSymbol("do"), listNthCdr(objPtr, 2)), TailCallOptimisation);
-	}
-	else if (operand == "lambda") {
-		if (2 <= length) {
-			BObjSharedPtr pl = listNth(objPtr, 1);
-			closed = true;
-			return std::make_shared<Proc>(pl, std::make_shared<Cons>(registerSymbol("do"), listNthCdr(objPtr, 2)), EnvSPtr(envobj));
-		}
-	}
-	else if (operand == "macro") {
-		if (2 <= length) {
-			BObjSharedPtr pl = listNth(objPtr, 1);
-			closed = true;
-			return std::make_shared<Macro>(pl, std::make_shared<Cons>(registerSymbol("do"), listNthCdr(objPtr, 2)), EnvSPtr(envobj));
-		}
-	}
-	return BObjSharedPtr(nullptr);
+LObj Env::eval(LObj objPtr) {
+	return Interpreter::current().machine.execute(compile(analyze(objPtr)), this);
 }
 
-BObjSharedPtr Env::eval(BObjSharedPtr objPtr, bool tail) {
-	Base_Object* B_o = objPtr.get();
-	if (B_o->typep<Symbol>()) {
-		BObjSharedPtr rr = findSymbolInMap(&B_o->getAs<Symbol>());
-		if (rr == nullptr) {
-			std::cout << "Unresolvable symbol: " << B_o->getAs<Symbol>().name << std::endl;
-			throw "Evaluated unresolvable symbol";
+bool MacroCache::markExpansions() {
+	bool marked = false;
+	for (auto& [form, expansion] : entries) {
+		Base_Object* o = expansion.get();
+		if (form->gcMark != gc::Unmarked && o != nullptr && o->gcMark == gc::Unmarked) {
+			gc::mark(o);
+			marked = true;
 		}
-		return rr;
 	}
-	if (B_o->typep<Integer>() || B_o->typep<String>()) {
-		return objPtr;
-	}
-	if (B_o->typep<Cons>()) {
-		BObjSharedPtr psfr = procSpecialForm(objPtr, tail);
-		if (psfr != nullptr) {
-			return psfr;
-		}
+	return marked;
+}
 
-		Cons* cons = &B_o->getAs<Cons>();
-		BObjSharedPtr opPtr = eval(cons->car);
-		if (opPtr->typep<Proc>()) {
-			Proc* func = &opPtr->getAs<Proc>();
-			EnvSPtr env = makeEnvForApply(EnvSPtr(envobj), func->env,
-				func->parameterList, cons->cdr, tail);
-			return env->eval(func->body, TailCallOptimisation);
-		}
+void MacroCache::sweep() {
+	std::erase_if(entries, [](const auto& entry) {
+		return entry.first->gcMark == gc::Unmarked;
+		});
+}
 
-		if (opPtr->typep<PredefinedProc>()) {
-			PredefinedProc* bfunc = &opPtr->getAs<PredefinedProc>();
-			Base_Object* argCons = cons->cdr.get();
-			if (!isProperList(argCons))
-				throw "Wrong usage of Predefined Function";
-			std::vector<BObjSharedPtr> args;
-			while (!argCons->isnull()) {
-				args.push_back(eval(argCons->getAs<Cons>().car));
-				argCons = argCons->getAs<Cons>().cdr.get();
-			}
-			return bfunc->function(*this, args);
-		}
-		throw "Wrong usage";
-	}
-	return objPtr;
+bool gc::markInterpreterEphemerons() {
+	return macroCache().markExpansions();
 }
 
+void gc::sweepInterpreterWeakRefs() {
+	macroCache().sweep();
+}
+
+void gc::markInterpreterRoots() {
+	Interpreter& interpreter = Interpreter::current();
+	gc::mark(interpreter.environment);
+	interpreter.symbols.trace();
+	interpreter.machine.trace();
+	interpreter.profiler.trace();
+	std::erase_if(interpreter.tasks, [](const std::weak_ptr<Task>& t) {
+		std::shared_ptr<Task> task = t.lock();
+		if (task == nullptr)
+			return true;
+		task->trace();
+		return false;
+		});
+	if (interpreter.parent == nullptr && !gc::isShared(interpreter.ownHeap()))
+		interpreter.environment->releaseReplaced();
+}
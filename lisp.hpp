@@ -1,40 +1,90 @@
 #pragma once
+#include <atomic>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <memory>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <utility>
 #include <stdint.h>
 #include <fstream>
 #include <ctime>
 #include <functional>
+#include <span>
 #include <type_traits>
+#include "gc.hpp"
 
 constexpr auto TailCallOptimisation = true;
+// Compiles in the call profiler behind profile-start; when false the VM
+// carries no profiling code at all.
+constexpr auto Profiling = false;
 
 class Env;
+class Code;
+class Frame;
+
+// Concrete type of an object, stored in one byte of every heap object and
+// derived from the tag bits for immediates.
+enum class Type : uint8_t {
+	Empty,
+	Fixnum,
+	Symbol,
+	Cons,
+	String,
+	Bignum,
+	Float,
+	Vector,
+	HashTable,
+	Proc,
+	PredefinedProc,
+	Macro,
+	Env,
+	Code,
+	Frame,
+	Const,
+	LocalRef,
+	GlobalRef,
+	If,
+	Seq,
+	Define,
+	Set,
+	Let,
+	Lambda,
+	Call,
+	Future,
+	Count
+};
 
 class Base_Object {
 public:
+	uint8_t gcMark = gc::Unmarked;
+	const Type type;
+
+	explicit Base_Object(Type t)
+		: type(t) {}
 	virtual ~Base_Object() = default;
 
+	virtual void trace() const {}
+
 	template<typename T>
 		requires std::is_base_of_v<Base_Object, T>
 	bool typep() const {
-		return typeid(*this) == typeid(T);
+		return type == T::TypeTag;
 	}
 
 	template<typename T>
 		requires std::is_base_of_v<Base_Object, T>
 	T& getAs() {
-		return dynamic_cast<T&>(*this);
+		return static_cast<T&>(*this);
 	}
 
 	template<typename T>
 		requires std::is_base_of_v<Base_Object, T>
 	const T& getAs() const {
-		return dynamic_cast<const T&>(*this);
+		return static_cast<const T&>(*this);
 	}
 
 	virtual std::ostream& operator<<(std::ostream& os) const = 0;
@@ -43,44 +93,160 @@ public:
 	{
 		return &l == &r;
 	}
+};
+
+class Symbol;
+
+// A tagged machine word. Fixnums are immediates; everything else points into
+// the collected heap.
+//   ...xxx1  fixnum (63 bit)
+//   ...x010  Symbol*
+//   ...x000  Base_Object*, 0 is the empty object
+class LObj {
+private:
+	static constexpr uintptr_t TagMask = 7;
+	static constexpr uintptr_t FixnumTag = 1;
+	static constexpr uintptr_t SymbolTag = 2;
+	static constexpr uintptr_t HeapTag = 0;
+
+	uintptr_t bits;
+
+	explicit LObj(uintptr_t b, int)
+		: bits(b) {}
+
+	Base_Object* heapPtr() const {
+		return reinterpret_cast<Base_Object*>(bits);
+	}
+
+public:
+	LObj()
+		: bits(0) {}
+	LObj(std::nullptr_t)
+		: bits(0) {}
+	LObj(Symbol* s)
+		: bits(reinterpret_cast<uintptr_t>(s) | SymbolTag) {}
+
+	template<typename T>
+		requires (std::is_base_of_v<Base_Object, T> && !std::is_same_v<T, Symbol>)
+	LObj(T* o)
+		: bits(reinterpret_cast<uintptr_t>(static_cast<Base_Object*>(o))) {}
+
+	static constexpr intptr_t FixnumMax = INTPTR_MAX >> 1;
+	static constexpr intptr_t FixnumMin = INTPTR_MIN >> 1;
+
+	static LObj fixnum(intptr_t v) {
+		return LObj((static_cast<uintptr_t>(v) << 1) | FixnumTag, 0);
+	}
+
+	bool isFixnum() const {
+		return bits & FixnumTag;
+	}
+	bool isSymbol() const {
+		return (bits & TagMask) == SymbolTag;
+	}
+	bool isHeap() const {
+		return bits != 0 && (bits & TagMask) == HeapTag;
+	}
+
+	intptr_t fixnumValue() const {
+		return static_cast<intptr_t>(bits) >> 1;
+	}
+
+	Base_Object* get() const {
+		if (isFixnum()) return nullptr;
+		return reinterpret_cast<Base_Object*>(bits & ~TagMask);
+	}
+	Base_Object* operator->() const {
+		return get();
+	}
+	Base_Object& operator*() const {
+		return *get();
+	}
+
+	Type type() const {
+		static constexpr Type ImmediateTypes[] = {
+			Type::Empty, Type::Fixnum, Type::Symbol, Type::Fixnum,
+			Type::Empty, Type::Fixnum, Type::Empty, Type::Fixnum
+		};
+		if (isHeap())
+			return heapPtr()->type;
+		return ImmediateTypes[bits & TagMask];
+	}
+
+	template<typename T>
+		requires std::is_base_of_v<Base_Object, T>
+	bool typep() const {
+		if constexpr (std::is_same_v<T, Symbol>)
+			return isSymbol();
+		else
+			return isHeap() && heapPtr()->type == T::TypeTag;
+	}
+
+	template<typename T>
+		requires std::is_base_of_v<Base_Object, T>
+	T& getAs() const {
+		return get()->getAs<T>();
+	}
 
 	bool isnull() const;
+
+	// Hashes by identity, consistent with operator==.
+	struct IdentityHash {
+		size_t operator()(const LObj& o) const {
+			return std::hash<uintptr_t>()(o.bits);
+		}
+	};
+
+	friend bool operator==(const LObj& l, const LObj& r)
+	{
+		return l.bits == r.bits;
+	}
+	friend bool operator==(const LObj& l, std::nullptr_t)
+	{
+		return l.bits == 0;
+	}
 };
 
-using BObjSharedPtr = std::shared_ptr<Base_Object>;
-using EnvSPtr = std::shared_ptr<Env>;
-using EnvWPtr = std::weak_ptr<Env>;
+std::ostream& operator<<(std::ostream& os, const LObj& o);
+
+// The global environment of the interpreter current on this thread.
+Env* rootEnvironment();
 
-extern int totalSym;
-extern std::map<std::string, BObjSharedPtr> sMap;
-extern EnvSPtr Environment;
+template<typename T, typename... Args>
+	requires std::is_base_of_v<Base_Object, T>
+LObj makeObj(Args&&... args) {
+	return LObj(gcNew<T>(std::forward<Args>(args)...));
+}
 
 class Cons : public Base_Object {
 public:
-	BObjSharedPtr car;
-	BObjSharedPtr cdr;
+	static constexpr Type TypeTag = Type::Cons;
+	LObj car;
+	LObj cdr;
 
-	Cons(BObjSharedPtr a, BObjSharedPtr d)
-		: car(std::move(a)), cdr(std::move(d)) {}
+	Cons(LObj a, LObj d)
+		: Base_Object(TypeTag), car(a), cdr(d) {}
+
+	void trace() const override {
+		gc::mark(car);
+		gc::mark(cdr);
+	}
 
 	std::ostream& operator<<(std::ostream& os) const override {
-		os << "(";
-		car->operator<<(os);
+		os << "(" << car;
 
-		Base_Object* o = cdr.get();
+		const Cons* c = this;
 		while (true) {
-			if (o->typep<Cons>()) {
-				os << " ";
-				Cons* nestedCons = &o->getAs<Cons>();
-				nestedCons->car->operator<<(os);
-				o = nestedCons->cdr.get();
+			const LObj& o = c->cdr;
+			if (o.typep<Cons>()) {
+				c = &o.getAs<Cons>();
+				os << " " << c->car;
 			}
-			else if (o->isnull()) {
+			else if (o.isnull()) {
 				break;
 			}
 			else {
-				os << " . ";
-				o->operator<<(os);
+				os << " . " << o;
 				break;
 			}
 		}
@@ -91,10 +257,52 @@ public:
 
 class Symbol : public Base_Object {
 public:
+	static constexpr Type TypeTag = Type::Symbol;
 	const std::string name;
+	const size_t hash;
+	// The global binding, empty while unbound. It is read directly unless
+	// the symbol has ever been bound dynamically, in which case a dynamic
+	// binding may shadow it and the Env chain has to be searched. Only the
+	// owning interpreter writes it, but its parallel tasks read it at the
+	// same time: stores release and loads acquire, so that a task sees the
+	// object a new value points to.
+	std::atomic<LObj> value;
+	std::atomic<bool> dynamic = false;
+	// Set once the global binding is replaced; calls open-coded by the VM
+	// check it, together with `dynamic`, before taking their fast path.
+	std::atomic<bool> rebound = false;
+	// Kept apart from gcMark, which a collector of the owning heap writes
+	// while tasks look the symbol up.
+	const bool shared = false;
+
+	Symbol(std::string_view n)
+		: Base_Object(TypeTag), name(n), hash(hashName(n)) {}
+	// A statically allocated symbol; a constant one evaluates to itself.
+	Symbol(std::string_view n, bool constant)
+		: Base_Object(TypeTag), name(n), hash(hashName(n)), shared(true) {
+		gcMark = gc::Immortal;
+		if (constant)
+			value.store(LObj(this), std::memory_order_relaxed);
+	}
+
+	// Statically allocated symbols are shared by every interpreter; their
+	// cells are never written after construction.
+	bool isShared() const {
+		return shared;
+	}
 
-	Symbol(const std::string n)
-		: name(n) {}
+	void trace() const override {
+		gc::mark(value.load(std::memory_order_relaxed));
+	}
+
+	static constexpr size_t hashName(std::string_view n) {
+		uint64_t h = 14695981039346656037ull;
+		for (char c : n) {
+			h ^= static_cast<uint8_t>(c);
+			h *= 1099511628211ull;
+		}
+		return static_cast<size_t>(h);
+	}
 
 	std::ostream& operator<<(std::ostream& os) const override {
 		os << name;
@@ -102,29 +310,58 @@ public:
 	}
 };
 
-class Integer : public Base_Object {
-public:
-	int value;
+// Symbols the interpreter refers to itself. They are statically allocated
+// and interned before any other symbol, so tests against them are pointer
+// compares. Every interpreter shares them, so the constant ones cannot be
+// rebound and the globals of the others live in each root Env.
+namespace Symbols {
+	extern Symbol Null;
+	extern Symbol T;
+	extern Symbol F;
+	extern Symbol Quote;
+	extern Symbol If;
+	extern Symbol Do;
+	extern Symbol Define;
+	extern Symbol Set;
+	extern Symbol Let;
+	extern Symbol LetStar;
+	extern Symbol Lambda;
+	extern Symbol Macro;
+	extern Symbol Exit;
+	extern Symbol Future;
+}
+
+inline bool LObj::isnull() const {
+	return *this == LObj(&Symbols::Null);
+}
+
+// Open-addressing intern table from names to symbols.
+class SymbolTable {
+private:
+	std::vector<Symbol*> slots;
+	size_t count = 0;
 
-	Integer(int v)
-		: value(v) {}
+	void insert(Symbol* symbol);
 
-	std::ostream& operator<<(std::ostream& os) const override {
-		os << value;
-		return os;
-	}
-	friend bool operator==(const Integer& l, const Integer& r)
-	{
-		return r.typep<Integer>() && l.value == r.getAs<Integer>().value;
+public:
+	SymbolTable();
+
+	Symbol* intern(std::string_view name);
+	size_t size() const {
+		return count;
 	}
+	void trace() const;
 };
 
+SymbolTable& symbolTable();
+
 class String : public Base_Object {
 public:
+	static constexpr Type TypeTag = Type::String;
 	std::string value;
 
 	String(const std::string& v)
-		: value(v) {}
+		: Base_Object(TypeTag), value(v) {}
 
 	std::ostream& operator<<(std::ostream& os) const override {
 		os << value;
@@ -136,26 +373,113 @@ public:
 	}
 };
 
+class Vector : public Base_Object {
+public:
+	static constexpr Type TypeTag = Type::Vector;
+	// Longest vector make-vector creates, 2 GB of slots.
+	static constexpr size_t MaxLength = size_t(1) << 28;
+	std::vector<LObj> values;
+
+	Vector(std::vector<LObj> v)
+		: Base_Object(TypeTag), values(std::move(v)) {}
+
+	void trace() const override {
+		for (const LObj& o : values)
+			gc::mark(o);
+	}
+
+	std::ostream& operator<<(std::ostream& os) const override {
+		os << "#(";
+		for (size_t i = 0; i < values.size(); ++i) {
+			if (i != 0) os << " ";
+			os << values[i];
+		}
+		os << ")";
+		return os;
+	}
+};
 
 class Proc : public Base_Object {
 public:
-	BObjSharedPtr parameterList;
-	BObjSharedPtr body;
-	EnvSPtr env;
-	Proc(BObjSharedPtr pl, BObjSharedPtr b, EnvSPtr e)
-		: parameterList(pl), body(b), env(e) {}
+	static constexpr Type TypeTag = Type::Proc;
+	Code* code;
+	Frame* env;
+	Proc(Code* c, Frame* e)
+		: Base_Object(TypeTag), code(c), env(e) {}
+	void trace() const override;
 	std::ostream& operator<<(std::ostream& os) const override {
 		os << "<Proc>";
 		return os;
 	}
 };
 
+// A builtin is a plain function taking up to three arguments by value, or
+// a variadic one taking a span over the caller's stack slots. The argument
+// count is checked here, once, before the function is entered.
 class PredefinedProc : public Base_Object {
 public:
-	std::function<BObjSharedPtr(Env& env, std::vector<BObjSharedPtr>&)> function;
+	static constexpr Type TypeTag = Type::PredefinedProc;
+	static constexpr uint16_t Variadic = UINT16_MAX;
+
+	using Fn0 = LObj(*)(Env&);
+	using Fn1 = LObj(*)(Env&, LObj);
+	using Fn2 = LObj(*)(Env&, LObj, LObj);
+	using Fn3 = LObj(*)(Env&, LObj, LObj, LObj);
+	using FnN = LObj(*)(Env&, std::span<LObj>);
+
+	const char* const name;
 
-	PredefinedProc(std::function<BObjSharedPtr(Env& env, std::vector<BObjSharedPtr>&)> f)
-		: function(f) {}
+private:
+	union {
+		Fn0 f0;
+		Fn1 f1;
+		Fn2 f2;
+		Fn3 f3;
+		FnN fn;
+	};
+	uint16_t minArgs;
+	uint16_t maxArgs;
+	bool variadic;
+	std::string invalidArguments;
+
+	PredefinedProc(const char* n, uint16_t min, uint16_t max, bool v)
+		: Base_Object(TypeTag), name(n), minArgs(min), maxArgs(max), variadic(v),
+		invalidArguments(std::string("Invalid arguments of function '") + n + "'") {}
+
+public:
+	PredefinedProc(const char* name, Fn0 f)
+		: PredefinedProc(name, 0, 0, false) {
+		f0 = f;
+	}
+	PredefinedProc(const char* name, Fn1 f)
+		: PredefinedProc(name, 1, 1, false) {
+		f1 = f;
+	}
+	PredefinedProc(const char* name, Fn2 f)
+		: PredefinedProc(name, 2, 2, false) {
+		f2 = f;
+	}
+	PredefinedProc(const char* name, Fn3 f)
+		: PredefinedProc(name, 3, 3, false) {
+		f3 = f;
+	}
+	PredefinedProc(const char* name, uint16_t min, uint16_t max, FnN f)
+		: PredefinedProc(name, min, max, true) {
+		fn = f;
+	}
+
+	LObj call(Env& env, LObj* args, size_t argc) const {
+		if (argc < minArgs || argc > maxArgs)
+			throw invalidArguments.c_str();
+		if (variadic)
+			return fn(env, std::span<LObj>(args, argc));
+		switch (argc) {
+		case 0: return f0(env);
+		case 1: return f1(env, args[0]);
+		case 2: return f2(env, args[0], args[1]);
+		default: return f3(env, args[0], args[1], args[2]);
+		}
+	}
 
 	std::ostream& operator<<(std::ostream& os) const override {
 		os << "<PredefinedProc>";
@@ -165,12 +489,13 @@ public:
 
 class Macro : public Base_Object {
 public:
-	BObjSharedPtr parameterList;
-	BObjSharedPtr body;
-	EnvSPtr env;
+	static constexpr Type TypeTag = Type::Macro;
+	Code* code;
+	Frame* env;
 
-	Macro(BObjSharedPtr pl, BObjSharedPtr b, EnvSPtr e)
-		: parameterList(pl), body(b), env(e) {}
+	Macro(Code* c, Frame* e)
+		: Base_Object(TypeTag), code(c), env(e) {}
+	void trace() const override;
 
 	std::ostream& operator<<(std::ostream& os) const override {
 		os << "<Macro>";
@@ -179,126 +504,274 @@ public:
 };
 
 
-BObjSharedPtr readParse(Env& env, std::istream& is);
+extern LObj registerSymbol(std::string_view name);
+
+bool isProperList(const LObj& obj);
+int listLength(const LObj& obj);
+LObj listNth(const LObj& objptr, int i);
+LObj listNthCdr(const LObj& objptr, int i);
+LObj vectorToList(std::vector<LObj>& v);
+std::vector<LObj> listToVector(const LObj& list);
 
-extern BObjSharedPtr registerSymbol(std::string name);
+// Allocation counters as an alist: heap totals, then (type live allocated)
+// for every type allocated so far.
+LObj heapStats();
+void printHeapStats(std::ostream& os);
 
-class Env {
+// Fully macro-expanded forms keyed by the identity of their source cons.
+// Keys are weak: an entry is dropped once its source form is garbage. Any
+// change to a macro binding clears the cache.
+class MacroCache {
 private:
-	EnvWPtr envobj;
-	EnvSPtr outEnvironment;
-	EnvSPtr environmentLex;
-	std::map<Symbol*, BObjSharedPtr> symbolValueMap;
-	bool closed = true;
+	std::unordered_map<const Cons*, LObj> entries;
+
+public:
+	LObj find(const Cons* form) const {
+		auto it = entries.find(form);
+		return it != entries.end() ? it->second : LObj(nullptr);
+	}
+
+	void insert(const Cons* form, LObj expansion) {
+		entries[form] = expansion;
+	}
+
+	void clear() {
+		entries.clear();
+	}
+
+	bool markExpansions();
+	void sweep();
+};
+
+MacroCache& macroCache();
+
+// Global variables and the dynamic bindings that shadow them; lexical
+// variables live in VM stack slots and Frames. The root Env keeps global
+// values in the Symbols' own cells, except for shared symbols, whose globals
+// go in sharedGlobals; each sub-environment holds one level of dynamic
+// bindings in its map.
+class Env : public Base_Object {
+private:
+	Env* outEnvironment = nullptr;
+	std::map<Symbol*, LObj> symbolValueMap;
+	// A cell for every non-constant shared symbol, made with the root Env
+	// so that parallel tasks can read it while the map itself never changes.
+	std::map<Symbol*, std::atomic<LObj>> sharedGlobals;
+	std::vector<Symbol*> globals;
+	// Every builtin of a root Env, so that saved code can be relinked to
+	// them by name whatever the globals are bound to now.
+	std::vector<PredefinedProc*> builtins;
+	// Values of root bindings replaced while parallel tasks, which may have
+	// read them, were running; kept alive until those tasks are done.
+	std::vector<LObj> replaced;
+
+	bool isRoot() const {
+		return outEnvironment == nullptr;
+	}
+
+	void printBindings() const {
+		auto printBinding = [](const Symbol* symbol, const LObj& value) {
+			symbol->operator<<(std::cout);
+			std::cout << ":";
+			std::cout << value;
+			std::cout << ",";
+		};
+		if (isRoot()) {
+			for (const Symbol* symbol : globals)
+				printBinding(symbol, symbol->value.load(std::memory_order_relaxed));
+			for (auto& [symbol, value] : sharedGlobals) {
+				if (value.load(std::memory_order_relaxed) != nullptr)
+					printBinding(symbol, value.load(std::memory_order_relaxed));
+			}
+		}
+		for (auto& kv : symbolValueMap)
+			printBinding(kv.first, kv.second);
+	}
 
 public:
+	static constexpr Type TypeTag = Type::Env;
+
 	Env();
-	Env(EnvSPtr e, EnvSPtr l)
-		: outEnvironment(e), environmentLex(l), closed(false) {}
+	Env(Env* e)
+		: Base_Object(TypeTag), outEnvironment(e) {}
 
-	static EnvSPtr createEnvironment() {
-		EnvSPtr env = std::make_shared<Env>();
-		env->envobj = env;
-		return env;
+	static Env* createEnvironment() {
+		return gcNew<Env>();
 	}
 
-	EnvSPtr createSubEnvironment(EnvSPtr l = nullptr) const {
-		EnvSPtr env = std::make_shared<Env>(EnvSPtr(envobj), l);
-		env->envobj = env;
-		return env;
+	Env* createSubEnvironment() {
+		return gcNew<Env>(this);
 	}
 
-	EnvSPtr findEnvironment(Symbol* symbol) const {
-		if (isSpecialVariable(symbol))
-			return resolveEnvDyn(symbol);
-		else
-			return resolveEnvLex(symbol);
+	Env* getOutEnv() const {
+		return outEnvironment;
 	}
 
-	EnvSPtr resolveEnvDyn(Symbol* symbol) const {
-		if (symbolValueMap.count(symbol))
-			return EnvSPtr(envobj);
-		if (outEnvironment != nullptr)
-			return outEnvironment->resolveEnvDyn(symbol);
-		return EnvSPtr(nullptr);
+	// Folds the bindings of this Env and of every Env between it and `base`
+	// into the outermost of them, inner bindings shadowing outer ones, and
+	// returns that Env. Only for Envs that nothing else refers to, such as
+	// those a VM frame pushed for its own special variables.
+	Env* collapseInto(Env* base) {
+		if (this == base || outEnvironment == base)
+			return this;
+		std::vector<Env*> chain;
+		for (Env* env = this; env != base; env = env->outEnvironment)
+			chain.push_back(env);
+		if (chain.size() < 2)
+			return this;
+		Env* outer = chain.back();
+		for (size_t i = chain.size() - 1; i-- > 0;) {
+			for (auto& [symbol, value] : chain[i]->symbolValueMap)
+				outer->symbolValueMap.insert_or_assign(symbol, value);
+		}
+		return outer;
 	}
 
-	EnvSPtr resolveEnvLex(Symbol* symbol) const {
-		if (symbolValueMap.count(symbol))
-			return EnvSPtr(envobj);
-		if (environmentLex != nullptr)
-			return environmentLex->resolveEnvLex(symbol);
-		if (outEnvironment != nullptr)
-			return outEnvironment->resolveEnvLex(symbol);
-		return EnvSPtr(nullptr);
+	LObj globalValue(Symbol* symbol) const {
+		LObj value = symbol->value.load(std::memory_order_acquire);
+		if (symbol->isShared() && value == nullptr)
+			return sharedGlobalValue(symbol);
+		return value;
 	}
 
-	BObjSharedPtr findSymbolInMap(Symbol* symbol) {
-		EnvSPtr env = findEnvironment(symbol);
-		if (env == nullptr) return BObjSharedPtr(nullptr);
-		return env->symbolValueMap[symbol];
+	LObj sharedGlobalValue(Symbol* symbol) const;
+
+	Env* findEnvironment(Symbol* symbol) {
+		Env* env = this;
+		for (; !env->isRoot(); env = env->outEnvironment) {
+			if ((symbol->dynamic || symbol->isShared()) && env->symbolValueMap.count(symbol))
+				return env;
+		}
+		return env->globalValue(symbol) != nullptr ? env : nullptr;
 	}
 
-	void bind(BObjSharedPtr objPtr, Symbol* symbol) {
-		symbolValueMap[symbol] = objPtr;
+	LObj findSymbolInMap(Symbol* symbol) const {
+		if (!symbol->dynamic && !symbol->isShared())
+			return symbol->value.load(std::memory_order_acquire);
+		const Env* env = this;
+		for (; !env->isRoot(); env = env->outEnvironment) {
+			auto it = env->symbolValueMap.find(symbol);
+			if (it != env->symbolValueMap.end())
+				return it->second;
+		}
+		return env->globalValue(symbol);
 	}
 
-	bool isSpecialVariable(Symbol* symbol) const {
-		return Environment->symbolValueMap.count(symbol);
+	void bind(LObj objPtr, Symbol* symbol) {
+		if (!gc::isLocal(this))
+			throw "Cannot change a global variable inside a parallel task";
+		LObj previous;
+		if (isRoot() && symbol->isShared()) {
+			if (symbol->value.load(std::memory_order_relaxed) != nullptr)
+				throw "Cannot rebind a constant symbol";
+			previous = sharedGlobals.at(symbol).exchange(objPtr, std::memory_order_release);
+		}
+		else if (isRoot()) {
+			if (symbol->value.load(std::memory_order_relaxed) == nullptr)
+				globals.push_back(symbol);
+			else
+				symbol->rebound.store(true, std::memory_order_relaxed);
+			previous = symbol->value.exchange(objPtr, std::memory_order_release);
+		}
+		else {
+			if (!symbol->isShared())
+				symbol->dynamic.store(true, std::memory_order_relaxed);
+			previous = std::exchange(symbolValueMap[symbol], objPtr);
+		}
+		if (isRoot() && previous != nullptr && gc::isShared(gc::currentHeap()))
+			replaced.push_back(previous);
+		if (objPtr.typep<Macro>() || previous.typep<Macro>())
+			macroCache().clear();
 	}
 
-	void merge(EnvSPtr env) {
-		for (auto& kv : env->symbolValueMap) {
-			symbolValueMap[kv.first] = kv.second;
+	PredefinedProc* findBuiltin(std::string_view name) const {
+		for (PredefinedProc* builtin : builtins) {
+			if (builtin->name == name)
+				return builtin;
 		}
-		if (env->environmentLex != nullptr)
-			environmentLex = env->environmentLex;
+		return nullptr;
 	}
 
-	void setLexEnv(EnvSPtr l) {
-		if (l != nullptr)
-			environmentLex = l;
+	// Calls f(symbol, value) for every global variable of a root Env except
+	// the constant symbols.
+	template<typename F>
+	void forEachGlobal(F f) const {
+		for (Symbol* symbol : globals) {
+			if (!symbol->isShared())
+				f(symbol, symbol->value.load(std::memory_order_relaxed));
+		}
+		for (auto& [symbol, value] : sharedGlobals) {
+			if (value.load(std::memory_order_relaxed) != nullptr)
+				f(symbol, value.load(std::memory_order_relaxed));
+		}
 	}
 
-	bool isClosed() const {
-		return closed;
+	static bool isSpecialVariable(Symbol* symbol) {
+		if (symbol->isShared())
+			return rootEnvironment()->globalValue(symbol) != nullptr;
+		return symbol->value.load(std::memory_order_relaxed) != nullptr;
 	}
 
-	BObjSharedPtr read(std::istream& is);
+	void trace() const override {
+		gc::mark(outEnvironment);
+		for (auto& kv : symbolValueMap) {
+			gc::mark(kv.first);
+			gc::mark(kv.second);
+		}
+		for (Symbol* symbol : globals) {
+			gc::mark(symbol);
+			gc::mark(symbol->value.load(std::memory_order_relaxed));
+		}
+		for (auto& [symbol, value] : sharedGlobals)
+			gc::mark(value.load(std::memory_order_relaxed));
+		for (PredefinedProc* builtin : builtins)
+			gc::mark(builtin);
+		for (const LObj& value : replaced)
+			gc::mark(value);
+	}
 
-	BObjSharedPtr macroExpand(BObjSharedPtr objPtr);
+	// Drops the replaced values kept for tasks once none is running.
+	void releaseReplaced() {
+		replaced.clear();
+	}
 
-	BObjSharedPtr procSpecialForm(BObjSharedPtr objPtr, bool tail = false);
+	std::ostream& operator<<(std::ostream& os) const override {
+		os << "<Env>";
+		return os;
+	}
+
+	LObj read(std::istream& is);
+	// Evaluates the forms of `is` until its end without prompting or
+	// echoing results, stopping at `exit` as repl does.
+	void run(std::istream& is);
 
-	BObjSharedPtr eval(BObjSharedPtr objPtr, bool tail = false);
+	LObj expandTree(LObj objPtr);
+	LObj macroExpand(LObj objPtr);
 
-	BObjSharedPtr evalTop(BObjSharedPtr objPtr) {
+	LObj eval(LObj objPtr);
+
+	LObj evalTop(LObj objPtr) {
 		return eval(macroExpand(objPtr));
 	}
 
 	void repl() {
 		while (1) {
 			std::cout << ">> ";
-			BObjSharedPtr o = read(std::cin);
+			LObj o = read(std::cin);
 			if (o == nullptr) {
 				std::cout << std::endl << "Parse failed." << std::endl;
 				return;
 			}
 			o = evalTop(o);
-			o->operator<<(std::cout);
+			std::cout << o;
 			std::cout << std::endl;
-			if (o == registerSymbol("exit")) break;
+			if (o == LObj(&Symbols::Exit)) break;
 		}
 	}
 
 	void print() const {
 		std::cout << "{";
-		for (auto& kv : symbolValueMap) {
-			kv.first->operator<<(std::cout);
-			std::cout << ":";
-			kv.second->operator<<(std::cout);
-			std::cout << ",";
-		}
+		printBindings();
 		std::cout << "}";
 	}
 
@@ -308,16 +781,7 @@ public:
 			return;
 		}
 		std::cout << "{";
-		for (auto& kv : symbolValueMap) {
-			kv.first->operator<<(std::cout);
-			std::cout << ":";
-			kv.second->operator<<(std::cout);
-			std::cout << ",";
-		}
-		if (environmentLex != nullptr) {
-			std::cout << "#lex:";
-			environmentLex->printAll(exceptRoot);
-		}
+		printBindings();
 		if (outEnvironment != nullptr) {
 			std::cout << "#outer:";
 			outEnvironment->printAll(exceptRoot);
@@ -1,12 +1,75 @@
-#include "lisp.hpp"
+#include "image.hpp"
+#include "interpreter.hpp"
+#include "reader.hpp"
+#include <cstring>
+#include <utility>
+#include <vector>
 
+namespace {
+	// What to evaluate in batch mode, in command-line order.
+	enum class Source { Expression, File, Stdin };
+
+	void runFile(Interpreter& interpreter, const std::string& path) {
+		if (hasCurrentCompiled(path)) {
+			loadCompiled(compiledPath(path), *interpreter.environment);
+			return;
+		}
+		MappedFile file(path);
+		if (!file.isOpen())
+			throw "Cannot open the script file";
+		interpreter.evaluate(file.view());
+	}
+}
+
+// lisp [--heap-stats] [--image FILE] [-e EXPR | FILE | -]...
+// With no expression, file or `-` (stdin) to run, starts the REPL.
 int main(int argc, char* argv[]) {
-	Environment = Env::createEnvironment();
+	bool heapStatsOnExit = false;
+	const char* imagePath = nullptr;
+	std::vector<std::pair<Source, const char*>> batch;
+	for (int i = 1; i < argc; ++i) {
+		if (std::strcmp(argv[i], "--heap-stats") == 0)
+			heapStatsOnExit = true;
+		else if (std::strcmp(argv[i], "--image") == 0 && i + 1 < argc)
+			imagePath = argv[++i];
+		else if (std::strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+			batch.emplace_back(Source::Expression, argv[++i]);
+		else if (std::strcmp(argv[i], "-") == 0)
+			batch.emplace_back(Source::Stdin, nullptr);
+		else
+			batch.emplace_back(Source::File, argv[i]);
+	}
+
+	// Output is only written when the buffer fills, on (flush) and at exit;
+	// the REPL keeps std::cin tied so that its prompt shows before reading.
+	std::ios_base::sync_with_stdio(false);
+	if (!batch.empty())
+		std::cin.tie(nullptr);
+
+	int status = 0;
+	Interpreter interpreter;
+	Interpreter::Scope scope(interpreter);
 	try {
-		Environment->repl();
+		if (imagePath != nullptr)
+			loadImage(imagePath);
+		if (batch.empty())
+			interpreter.environment->repl();
+		for (auto& [source, text] : batch) {
+			if (source == Source::Expression)
+				interpreter.evaluate(text);
+			else if (source == Source::File)
+				runFile(interpreter, text);
+			else
+				interpreter.environment->run(std::cin);
+		}
 	}
 	catch (char const* e) {
-		std::cout << "Exception error: " << e << std::endl;
+		std::cout.flush();
+		std::cerr << "Exception error: " << e << std::endl;
+		status = 1;
 	}
-	return 0;
-}
\ No newline at end of file
+	std::cout.flush();
+	if (heapStatsOnExit)
+		printHeapStats(std::cerr);
+	return status;
+}
@@ -0,0 +1,305 @@
+#include "number.hpp"
+#include <charconv>
+#include <cmath>
+#include <cstdlib>
+
+namespace {
+	using Magnitude = std::vector<uint32_t>;
+
+	struct Integer {
+		bool negative;
+		Magnitude magnitude;
+	};
+
+	void trim(Magnitude& m) {
+		while (!m.empty() && m.back() == 0) m.pop_back();
+	}
+
+	Magnitude magnitudeOf(uint64_t v) {
+		Magnitude m;
+		while (v != 0) {
+			m.push_back(static_cast<uint32_t>(v));
+			v >>= 32;
+		}
+		return m;
+	}
+
+	Integer unpack(const LObj& o) {
+		if (o.isFixnum()) {
+			intptr_t v = o.fixnumValue();
+			uint64_t abs = v < 0 ? 0 - static_cast<uint64_t>(v) : static_cast<uint64_t>(v);
+			return { v < 0, magnitudeOf(abs) };
+		}
+		const Bignum& b = o.getAs<Bignum>();
+		return { b.negative, b.magnitude };
+	}
+
+	LObj pack(bool negative, Magnitude m) {
+		trim(m);
+		if (m.size() <= 2) {
+			uint64_t abs = m.empty() ? 0 : m[0] | (m.size() == 2 ? static_cast<uint64_t>(m[1]) << 32 : 0);
+			if (!negative && abs <= static_cast<uint64_t>(LObj::FixnumMax))
+				return LObj::fixnum(static_cast<intptr_t>(abs));
+			if (negative && abs <= static_cast<uint64_t>(LObj::FixnumMax) + 1)
+				return LObj::fixnum(-static_cast<intptr_t>(abs - 1) - 1);
+		}
+		return makeObj<Bignum>(negative, std::move(m));
+	}
+
+	int compareMagnitude(const Magnitude& a, const Magnitude& b) {
+		if (a.size() != b.size())
+			return a.size() < b.size() ? -1 : 1;
+		for (size_t i = a.size(); i-- > 0;) {
+			if (a[i] != b[i])
+				return a[i] < b[i] ? -1 : 1;
+		}
+		return 0;
+	}
+
+	Magnitude addMagnitude(const Magnitude& a, const Magnitude& b) {
+		Magnitude r(std::max(a.size(), b.size()) + 1);
+		uint64_t carry = 0;
+		for (size_t i = 0; i < r.size(); ++i) {
+			uint64_t sum = carry;
+			if (i < a.size()) sum += a[i];
+			if (i < b.size()) sum += b[i];
+			r[i] = static_cast<uint32_t>(sum);
+			carry = sum >> 32;
+		}
+		trim(r);
+		return r;
+	}
+
+	// a - b where a >= b.
+	Magnitude subMagnitude(const Magnitude& a, const Magnitude& b) {
+		Magnitude r(a.size());
+		int64_t borrow = 0;
+		for (size_t i = 0; i < a.size(); ++i) {
+			int64_t diff = static_cast<int64_t>(a[i]) - borrow - (i < b.size() ? b[i] : 0);
+			borrow = diff < 0;
+			r[i] = static_cast<uint32_t>(diff + (borrow << 32));
+		}
+		trim(r);
+		return r;
+	}
+
+	Magnitude mulMagnitude(const Magnitude& a, const Magnitude& b) {
+		Magnitude r(a.size() + b.size());
+		for (size_t i = 0; i < a.size(); ++i) {
+			uint64_t carry = 0;
+			for (size_t j = 0; j < b.size(); ++j) {
+				uint64_t t = static_cast<uint64_t>(a[i]) * b[j] + r[i + j] + carry;
+				r[i + j] = static_cast<uint32_t>(t);
+				carry = t >> 32;
+			}
+			r[i + b.size()] = static_cast<uint32_t>(carry);
+		}
+		trim(r);
+		return r;
+	}
+
+	uint32_t divSmall(Magnitude& a, uint32_t d) {
+		uint64_t rem = 0;
+		for (size_t i = a.size(); i-- > 0;) {
+			uint64_t cur = (rem << 32) | a[i];
+			a[i] = static_cast<uint32_t>(cur / d);
+			rem = cur % d;
+		}
+		trim(a);
+		return static_cast<uint32_t>(rem);
+	}
+
+	// Shift-subtract long division; b is non-zero.
+	void divMagnitude(const Magnitude& a, const Magnitude& b, Magnitude& q, Magnitude& r) {
+		q.assign(a.size(), 0);
+		r.clear();
+		if (b.size() == 1) {
+			q = a;
+			uint32_t rem = divSmall(q, b[0]);
+			if (rem != 0) r.push_back(rem);
+			return;
+		}
+		for (size_t bit = a.size() * 32; bit-- > 0;) {
+			uint32_t carry = (a[bit / 32] >> (bit % 32)) & 1;
+			for (uint32_t& limb : r) {
+				uint32_t next = limb >> 31;
+				limb = (limb << 1) | carry;
+				carry = next;
+			}
+			if (carry != 0) r.push_back(carry);
+			if (compareMagnitude(r, b) >= 0) {
+				r = subMagnitude(r, b);
+				q[bit / 32] |= uint32_t(1) << (bit % 32);
+			}
+		}
+		trim(q);
+	}
+
+	LObj addInteger(const Integer& a, const Integer& b) {
+		if (a.negative == b.negative)
+			return pack(a.negative, addMagnitude(a.magnitude, b.magnitude));
+		if (compareMagnitude(a.magnitude, b.magnitude) >= 0)
+			return pack(a.negative, subMagnitude(a.magnitude, b.magnitude));
+		return pack(b.negative, subMagnitude(b.magnitude, a.magnitude));
+	}
+
+	int compareInteger(const Integer& a, const Integer& b) {
+		if (a.negative != b.negative)
+			return a.negative ? -1 : 1;
+		int c = compareMagnitude(a.magnitude, b.magnitude);
+		return a.negative ? -c : c;
+	}
+
+	LObj makeFloat(double v) {
+		return makeObj<Float>(v);
+	}
+
+	void checkNumbers(const LObj& a, const LObj& b) {
+		if (!isNumber(a) || !isNumber(b))
+			throw "Invalid arguments of numeric function";
+	}
+}
+
+LObj makeInteger(int64_t v) {
+	if (v >= LObj::FixnumMin && v <= LObj::FixnumMax)
+		return LObj::fixnum(static_cast<intptr_t>(v));
+	uint64_t abs = v < 0 ? 0 - static_cast<uint64_t>(v) : static_cast<uint64_t>(v);
+	return makeObj<Bignum>(v < 0, magnitudeOf(abs));
+}
+
+double toDouble(const LObj& o) {
+	if (o.isFixnum())
+		return static_cast<double>(o.fixnumValue());
+	if (o.typep<Float>())
+		return o.getAs<Float>().value;
+	const Bignum& b = o.getAs<Bignum>();
+	double v = 0;
+	for (size_t i = b.magnitude.size(); i-- > 0;)
+		v = v * 4294967296.0 + b.magnitude[i];
+	return b.negative ? -v : v;
+}
+
+LObj genericAdd(const LObj& a, const LObj& b) {
+	checkNumbers(a, b);
+	if (a.typep<Float>() || b.typep<Float>())
+		return makeFloat(toDouble(a) + toDouble(b));
+	return addInteger(unpack(a), unpack(b));
+}
+
+LObj genericSub(const LObj& a, const LObj& b) {
+	checkNumbers(a, b);
+	if (a.typep<Float>() || b.typep<Float>())
+		return makeFloat(toDouble(a) - toDouble(b));
+	Integer nb = unpack(b);
+	nb.negative = !nb.negative;
+	return addInteger(unpack(a), nb);
+}
+
+LObj genericMul(const LObj& a, const LObj& b) {
+	checkNumbers(a, b);
+	if (a.typep<Float>() || b.typep<Float>())
+		return makeFloat(toDouble(a) * toDouble(b));
+	Integer ia = unpack(a);
+	Integer ib = unpack(b);
+	return pack(ia.negative != ib.negative, mulMagnitude(ia.magnitude, ib.magnitude));
+}
+
+LObj numberDiv(const LObj& a, const LObj& b) {
+	checkNumbers(a, b);
+	if (a.typep<Float>() || b.typep<Float>())
+		return makeFloat(toDouble(a) / toDouble(b));
+	if (a.isFixnum() && b.isFixnum()) {
+		if (b.fixnumValue() == 0) throw "dividing by zero";
+		return makeInteger(a.fixnumValue() / b.fixnumValue());
+	}
+	Integer ia = unpack(a);
+	Integer ib = unpack(b);
+	if (ib.magnitude.empty()) throw "dividing by zero";
+	Magnitude q, r;
+	divMagnitude(ia.magnitude, ib.magnitude, q, r);
+	return pack(ia.negative != ib.negative, std::move(q));
+}
+
+LObj numberMod(const LObj& a, const LObj& b) {
+	checkNumbers(a, b);
+	if (a.typep<Float>() || b.typep<Float>())
+		return makeFloat(std::fmod(toDouble(a), toDouble(b)));
+	if (a.isFixnum() && b.isFixnum()) {
+		if (b.fixnumValue() == 0) throw "dividing by zero";
+		return LObj::fixnum(a.fixnumValue() % b.fixnumValue());
+	}
+	Integer ia = unpack(a);
+	Integer ib = unpack(b);
+	if (ib.magnitude.empty()) throw "dividing by zero";
+	Magnitude q, r;
+	divMagnitude(ia.magnitude, ib.magnitude, q, r);
+	return pack(ia.negative, std::move(r));
+}
+
+int genericCompare(const LObj& a, const LObj& b) {
+	checkNumbers(a, b);
+	if (a.typep<Float>() || b.typep<Float>()) {
+		double x = toDouble(a);
+		double y = toDouble(b);
+		return (x > y) - (x < y);
+	}
+	return compareInteger(unpack(a), unpack(b));
+}
+
+// Parses the longest number at `begin`: an integer, promoted to a bignum
+// when it does not fit in 64 bits, or a float when a fraction or exponent
+// follows the digits, as in 1.5, .5 or 1e3. Floats beyond the range of a
+// double read as infinity, and those too small for it as zero.
+LObj parseNumber(const char* begin, const char* end, const char*& next) {
+	long long i;
+	double d;
+	auto ri = std::from_chars(begin, end, i);
+	auto rd = std::from_chars(begin, end, d);
+	if (rd.ptr > ri.ptr) {
+		if (rd.ec == std::errc::result_out_of_range)
+			d = std::strtod(std::string(begin, rd.ptr).c_str(), nullptr);
+		else if (rd.ec != std::errc())
+			throw "Parser contains errors";
+		next = rd.ptr;
+		return makeFloat(d);
+	}
+	next = ri.ptr;
+	if (ri.ec == std::errc())
+		return makeInteger(i);
+	if (ri.ec != std::errc::result_out_of_range)
+		throw "Parser contains errors";
+	bool negative = *begin == '-';
+	Magnitude m;
+	for (const char* p = negative ? begin + 1 : begin; p != ri.ptr; ++p) {
+		Magnitude digit = magnitudeOf(static_cast<uint32_t>(*p - '0'));
+		m = addMagnitude(mulMagnitude(m, { 10 }), digit);
+	}
+	return pack(negative, std::move(m));
+}
+
+std::ostream& Bignum::operator<<(std::ostream& os) const {
+	Magnitude m = magnitude;
+	std::vector<uint32_t> chunks;
+	while (!m.empty())
+		chunks.push_back(divSmall(m, 1000000000));
+	if (chunks.empty())
+		chunks.push_back(0);
+	std::string digits = negative ? "-" : "";
+	digits += std::to_string(chunks.back());
+	for (size_t i = chunks.size() - 1; i-- > 0;) {
+		std::string chunk = std::to_string(chunks[i]);
+		digits += std::string(9 - chunk.size(), '0') + chunk;
+	}
+	os << digits;
+	return os;
+}
+
+std::ostream& Float::operator<<(std::ostream& os) const {
+	char buffer[32];
+	auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+	std::string_view text(buffer, result.ptr - buffer);
+	os << text;
+	if (std::isfinite(value) && text.find_first_of(".e") == std::string_view::npos)
+		os << ".0";
+	return os;
+}
@@ -0,0 +1,107 @@
+#pragma once
+#include "lisp.hpp"
+
+// Integers outside the fixnum range, as a sign and little-endian base 2^32
+// digits without leading zeros.
+class Bignum : public Base_Object {
+public:
+	static constexpr Type TypeTag = Type::Bignum;
+	bool negative;
+	std::vector<uint32_t> magnitude;
+
+	Bignum(bool n, std::vector<uint32_t> m)
+		: Base_Object(TypeTag), negative(n), magnitude(std::move(m)) {}
+
+	std::ostream& operator<<(std::ostream& os) const override;
+};
+
+class Float : public Base_Object {
+public:
+	static constexpr Type TypeTag = Type::Float;
+	double value;
+
+	Float(double v)
+		: Base_Object(TypeTag), value(v) {}
+
+	std::ostream& operator<<(std::ostream& os) const override;
+};
+
+inline bool isInteger(const LObj& o) {
+	return o.isFixnum() || o.typep<Bignum>();
+}
+
+inline bool isNumber(const LObj& o) {
+	return isInteger(o) || o.typep<Float>();
+}
+
+LObj makeInteger(int64_t v);
+LObj parseNumber(const char* begin, const char* end, const char*& next);
+double toDouble(const LObj& o);
+
+LObj genericAdd(const LObj& a, const LObj& b);
+LObj genericSub(const LObj& a, const LObj& b);
+LObj genericMul(const LObj& a, const LObj& b);
+LObj numberDiv(const LObj& a, const LObj& b);
+LObj numberMod(const LObj& a, const LObj& b);
+int genericCompare(const LObj& a, const LObj& b);
+
+// Fixnum arithmetic stays inline and allocation-free; anything that
+// overflows the fixnum range or involves another number type goes through
+// the generic path.
+namespace number {
+	inline bool addOverflow(intptr_t a, intptr_t b, intptr_t& r) {
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_add_overflow(a, b, &r) || r > LObj::FixnumMax || r < LObj::FixnumMin;
+#else
+		r = a + b;
+		return r > LObj::FixnumMax || r < LObj::FixnumMin;
+#endif
+	}
+
+	inline bool subOverflow(intptr_t a, intptr_t b, intptr_t& r) {
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_sub_overflow(a, b, &r) || r > LObj::FixnumMax || r < LObj::FixnumMin;
+#else
+		r = a - b;
+		return r > LObj::FixnumMax || r < LObj::FixnumMin;
+#endif
+	}
+
+	inline bool mulOverflow(intptr_t a, intptr_t b, intptr_t& r) {
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_mul_overflow(a, b, &r) || r > LObj::FixnumMax || r < LObj::FixnumMin;
+#else
+		if (a > INT32_MAX || a < INT32_MIN || b > INT32_MAX || b < INT32_MIN)
+			return true;
+		r = a * b;
+		return false;
+#endif
+	}
+}
+
+inline LObj numberAdd(const LObj& a, const LObj& b) {
+	intptr_t r;
+	if (a.isFixnum() && b.isFixnum() && !number::addOverflow(a.fixnumValue(), b.fixnumValue(), r))
+		return LObj::fixnum(r);
+	return genericAdd(a, b);
+}
+
+inline LObj numberSub(const LObj& a, const LObj& b) {
+	intptr_t r;
+	if (a.isFixnum() && b.isFixnum() && !number::subOverflow(a.fixnumValue(), b.fixnumValue(), r))
+		return LObj::fixnum(r);
+	return genericSub(a, b);
+}
+
+inline LObj numberMul(const LObj& a, const LObj& b) {
+	intptr_t r;
+	if (a.isFixnum() && b.isFixnum() && !number::mulOverflow(a.fixnumValue(), b.fixnumValue(), r))
+		return LObj::fixnum(r);
+	return genericMul(a, b);
+}
+
+inline int numberCompare(const LObj& a, const LObj& b) {
+	if (a.isFixnum() && b.isFixnum())
+		return (a.fixnumValue() > b.fixnumValue()) - (a.fixnumValue() < b.fixnumValue());
+	return genericCompare(a, b);
+}
@@ -0,0 +1,385 @@
+#include "parallel.hpp"
+#include "hashtable.hpp"
+#include "interpreter.hpp"
+#include "number.hpp"
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace {
+	// Slices per worker when a list is split across the pool; a few more
+	// slices than workers lets stealing even out slices of uneven cost.
+	constexpr size_t SlicesPerWorker = 4;
+
+	thread_local ThreadPool* workerPool = nullptr;
+	thread_local size_t workerIndex = 0;
+
+	// Copies the part of a task's result that lives in the task's heap into
+	// the current heap. Shared structure and cycles are preserved; objects
+	// of other heaps are the parent's own and are not copied.
+	class Adopter {
+	private:
+		gc::Heap* from;
+		std::unordered_map<const Base_Object*, LObj> copies;
+
+		LObj copyList(LObj list) {
+			std::vector<std::pair<Cons*, Cons*>> cells;
+			LObj head;
+			LObj rest = list;
+			while (rest.typep<Cons>() && gc::owns(from, rest.get()) && !copies.count(rest.get())) {
+				Cons* source = &rest.getAs<Cons>();
+				LObj cell = makeObj<Cons>(LObj(), LObj());
+				copies.emplace(source, cell);
+				if (cells.empty())
+					head = cell;
+				else
+					cells.back().second->cdr = cell;
+				cells.emplace_back(source, &cell.getAs<Cons>());
+				rest = source->cdr;
+			}
+			cells.back().second->cdr = copy(rest);
+			for (auto& [source, cell] : cells)
+				cell->car = copy(source->car);
+			return head;
+		}
+
+	public:
+		explicit Adopter(gc::Heap* h)
+			: from(h) {}
+
+		LObj copy(LObj o) {
+			if (!o.isHeap() || !gc::owns(from, o.get()))
+				return o;
+			auto it = copies.find(o.get());
+			if (it != copies.end())
+				return it->second;
+			switch (o.type()) {
+			case Type::Cons:
+				return copyList(o);
+			case Type::String:
+				return copies[o.get()] = makeObj<String>(o.getAs<String>().value);
+			case Type::Bignum:
+				return copies[o.get()] = makeObj<Bignum>(o.getAs<Bignum>().negative, o.getAs<Bignum>().magnitude);
+			case Type::Float:
+				return copies[o.get()] = makeObj<Float>(o.getAs<Float>().value);
+			case Type::Vector: {
+				const std::vector<LObj>& values = o.getAs<Vector>().values;
+				LObj v = makeObj<Vector>(std::vector<LObj>(values.size()));
+				copies.emplace(o.get(), v);
+				for (size_t i = 0; i < values.size(); ++i)
+					v.getAs<Vector>().values[i] = copy(values[i]);
+				return v;
+			}
+			case Type::HashTable: {
+				LObj table = makeObj<HashTable>(o.getAs<HashTable>().size());
+				copies.emplace(o.get(), table);
+				o.getAs<HashTable>().forEach([&](const LObj& key, const LObj& value) {
+					table.getAs<HashTable>().set(copy(key), copy(value));
+					});
+				return table;
+			}
+			default:
+				throw "A parallel task can only return lists, vectors, hash tables, strings and numbers";
+			}
+		}
+	};
+
+	// Task interpreters idle on this thread. A thread running a task may
+	// run another one while it waits, so it can have several in use.
+	thread_local std::vector<std::unique_ptr<Interpreter>> idleInterpreters;
+
+	std::shared_ptr<Task> startTask(std::vector<LObj> roots, std::function<LObj(Interpreter&)> body) {
+		Interpreter& interpreter = Interpreter::current();
+		auto task = std::make_shared<Task>(interpreter, std::move(roots), std::move(body));
+		std::erase_if(interpreter.tasks, [](const std::weak_ptr<Task>& t) { return t.expired(); });
+		interpreter.tasks.push_back(task);
+		ThreadPool::shared().submit(task);
+		return task;
+	}
+
+	// Runs `slice` over [0, count) split into ranges, one task per range,
+	// and appends the results of the ranges in order to `results`, which the
+	// caller roots. `roots` are the objects the slices read. Every task has
+	// finished before anything is thrown.
+	void runSlices(const std::vector<LObj>& roots, size_t count, std::function<LObj(Interpreter&, size_t, size_t)> slice, std::vector<LObj>& results) {
+		ThreadPool& pool = ThreadPool::shared();
+		size_t slices = std::min(count, pool.size() * SlicesPerWorker);
+		std::vector<std::shared_ptr<Task>> tasks;
+		for (size_t i = 0; i < slices; ++i) {
+			size_t begin = count * i / slices;
+			size_t end = count * (i + 1) / slices;
+			tasks.push_back(startTask(roots, [&slice, begin, end](Interpreter& child) {
+				return slice(child, begin, end);
+				}));
+		}
+		for (auto& task : tasks)
+			pool.wait(*task);
+		for (auto& task : tasks)
+			results.push_back(task->collect());
+	}
+}
+
+ThreadPool::ThreadPool(size_t threads) {
+	for (size_t i = 0; i < threads; ++i)
+		queues.push_back(std::make_unique<Queue>());
+	for (size_t i = 0; i < threads; ++i)
+		workers.emplace_back(&ThreadPool::work, this, i);
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard lock(sleepMutex);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (std::thread& worker : workers)
+		worker.join();
+}
+
+ThreadPool& ThreadPool::shared() {
+	static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+	return pool;
+}
+
+void ThreadPool::submit(std::shared_ptr<Job> job) {
+	size_t index = workerPool == this ? workerIndex : nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+	{
+		std::lock_guard lock(queues[index]->mutex);
+		queues[index]->jobs.push_back(std::move(job));
+	}
+	queued.fetch_add(1, std::memory_order_release);
+	{
+		std::lock_guard lock(sleepMutex);
+	}
+	wake.notify_one();
+}
+
+// A worker takes its own newest job first; anyone else takes the oldest job
+// of the first queue that has one.
+std::shared_ptr<Job> ThreadPool::take() {
+	if (queued.load(std::memory_order_acquire) == 0)
+		return nullptr;
+	bool worker = workerPool == this;
+	size_t start = worker ? workerIndex : 0;
+	if (worker) {
+		Queue& own = *queues[start];
+		std::lock_guard lock(own.mutex);
+		if (!own.jobs.empty()) {
+			std::shared_ptr<Job> job = std::move(own.jobs.back());
+			own.jobs.pop_back();
+			queued.fetch_sub(1, std::memory_order_relaxed);
+			return job;
+		}
+	}
+	for (size_t i = worker ? 1 : 0; i < queues.size(); ++i) {
+		Queue& victim = *queues[(start + i) % queues.size()];
+		std::lock_guard lock(victim.mutex);
+		if (!victim.jobs.empty()) {
+			std::shared_ptr<Job> job = std::move(victim.jobs.front());
+			victim.jobs.pop_front();
+			queued.fetch_sub(1, std::memory_order_relaxed);
+			return job;
+		}
+	}
+	return nullptr;
+}
+
+void ThreadPool::execute(Job& job) {
+	job.run();
+	job.done.store(true, std::memory_order_release);
+	{
+		std::lock_guard lock(sleepMutex);
+	}
+	wake.notify_all();
+}
+
+void ThreadPool::work(size_t index) {
+	workerPool = this;
+	workerIndex = index;
+	while (true) {
+		if (std::shared_ptr<Job> job = take()) {
+			execute(*job);
+			continue;
+		}
+		std::unique_lock lock(sleepMutex);
+		wake.wait(lock, [this] { return stopping || queued.load(std::memory_order_acquire) != 0; });
+		if (stopping)
+			return;
+	}
+}
+
+void ThreadPool::helpUntil(const std::function<bool()>& finished) {
+	while (!finished()) {
+		if (std::shared_ptr<Job> job = take()) {
+			execute(*job);
+			continue;
+		}
+		std::unique_lock lock(sleepMutex);
+		wake.wait(lock, [&] { return finished() || queued.load(std::memory_order_acquire) != 0; });
+	}
+}
+
+Task::Task(Interpreter& p, std::vector<LObj> r, std::function<LObj(Interpreter&)> b)
+	: parent(p), parentHeap(p.ownHeap()), roots(std::move(r)), body(std::move(b)) {
+	gc::share(parentHeap);
+}
+
+// Subtasks the task started may still be reading its heap.
+Task::~Task() {
+	if (heap == nullptr)
+		return;
+	if (gc::isShared(heap))
+		ThreadPool::shared().helpUntil([this] { return !gc::isShared(heap); });
+	gc::destroyHeap(heap);
+}
+
+void Task::run() {
+	std::unique_ptr<Interpreter> child;
+	if (idleInterpreters.empty()) {
+		child = std::make_unique<Interpreter>(parent);
+	}
+	else {
+		child = std::move(idleInterpreters.back());
+		idleInterpreters.pop_back();
+		child->beginTask(parent);
+	}
+	try {
+		Interpreter::Scope scope(*child);
+		result = body(*child);
+		seal(child->ownHeap());
+		sealed.store(true, std::memory_order_release);
+	}
+	catch (...) {
+		error = std::current_exception();
+	}
+	heap = child->endTask();
+	idleInterpreters.push_back(std::move(child));
+	gc::unshare(parentHeap);
+}
+
+// Checks that the result can be copied out of the task and records the
+// objects it borrows from other heaps, which the parent must keep alive
+// until the result is collected.
+void Task::seal(gc::Heap* heap) {
+	std::unordered_set<const Base_Object*> seen;
+	std::vector<LObj> pending{ result };
+	while (!pending.empty()) {
+		LObj o = pending.back();
+		pending.pop_back();
+		if (!o.isHeap() || !seen.insert(o.get()).second)
+			continue;
+		if (!gc::owns(heap, o.get())) {
+			borrowed.push_back(o);
+			continue;
+		}
+		switch (o.type()) {
+		case Type::Cons:
+			pending.push_back(o.getAs<Cons>().car);
+			pending.push_back(o.getAs<Cons>().cdr);
+			break;
+		case Type::Vector:
+			pending.insert(pending.end(), o.getAs<Vector>().values.begin(), o.getAs<Vector>().values.end());
+			break;
+		case Type::HashTable:
+			o.getAs<HashTable>().forEach([&](const LObj& key, const LObj& value) {
+				pending.push_back(key);
+				pending.push_back(value);
+				});
+			break;
+		case Type::String:
+		case Type::Bignum:
+		case Type::Float:
+			break;
+		default:
+			throw "A parallel task can only return lists, vectors, hash tables, strings and numbers";
+		}
+	}
+}
+
+LObj Task::collect() {
+	if (error)
+		std::rethrow_exception(error);
+	gc::DeferScope defer;
+	return Adopter(heap).copy(result);
+}
+
+void Task::trace() const {
+	for (const LObj& o : roots)
+		gc::mark(o);
+	if (!sealed.load(std::memory_order_acquire))
+		return;
+	for (const LObj& o : borrowed)
+		gc::mark(o);
+}
+
+void waitForTasksSlow(gc::Heap* heap) {
+	ThreadPool::shared().helpUntil([heap] { return !gc::isShared(heap); });
+}
+
+void Future::trace() const {
+	gc::mark(value);
+	if (task != nullptr)
+		task->trace();
+}
+
+LObj parallelMap(LObj fn, LObj list) {
+	std::vector<LObj> items = listToVector(list);
+	std::vector<LObj> slices;
+	gc::VectorRoot root(slices);
+	runSlices({ fn, list }, items.size(), [&](Interpreter& child, size_t begin, size_t end) {
+		std::vector<LObj> results;
+		gc::VectorRoot root(results);
+		for (size_t i = begin; i < end; ++i)
+			results.push_back(child.machine.apply(fn, { items[i] }, child.environment));
+		return vectorToList(results);
+		}, slices);
+	LObj result = LObj(&Symbols::Null);
+	for (auto it = slices.rbegin(); it != slices.rend(); ++it) {
+		if (!it->typep<Cons>())
+			continue;
+		Cons* last = &it->getAs<Cons>();
+		while (last->cdr.typep<Cons>())
+			last = &last->cdr.getAs<Cons>();
+		last->cdr = result;
+		result = *it;
+	}
+	return result;
+}
+
+LObj parallelReduce(LObj fn, LObj init, LObj list) {
+	std::vector<LObj> items = listToVector(list);
+	std::vector<LObj> partials;
+	gc::VectorRoot root(partials);
+	runSlices({ fn, init, list }, items.size(), [&](Interpreter& child, size_t begin, size_t end) {
+		// Only the first slice folds from init; each other slice starts
+		// from its own first item so that init is combined in once.
+		LObj acc = begin == 0 ? init : items[begin];
+		for (size_t i = begin == 0 ? begin : begin + 1; i < end; ++i)
+			acc = child.machine.apply(fn, { acc, items[i] }, child.environment);
+		return acc;
+		}, partials);
+	if (partials.empty())
+		return init;
+	Interpreter& interpreter = Interpreter::current();
+	LObj acc = partials[0];
+	for (size_t i = 1; i < partials.size(); ++i)
+		acc = interpreter.machine.apply(fn, { acc, partials[i] }, interpreter.environment);
+	return acc;
+}
+
+LObj spawnFuture(LObj thunk) {
+	return makeObj<Future>(startTask({ thunk }, [thunk](Interpreter& child) {
+		return child.machine.apply(thunk, {}, child.environment);
+		}));
+}
+
+LObj touchFuture(Future& future) {
+	if (!gc::isLocal(&future))
+		throw "Cannot touch a future of another interpreter";
+	if (future.task == nullptr)
+		return future.value;
+	ThreadPool::shared().wait(*future.task);
+	future.value = future.task->collect();
+	future.task.reset();
+	return future.value;
+}
@@ -0,0 +1,133 @@
+#pragma once
+#include "lisp.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+class Interpreter;
+
+// A unit of work for the ThreadPool.
+class Job {
+public:
+	std::atomic<bool> done = false;
+
+	virtual ~Job() = default;
+	virtual void run() = 0;
+};
+
+// One worker per core, each with a deque of its own: a worker pops the jobs
+// it pushed newest first and steals the oldest job of another worker when
+// it runs dry. A thread waiting for a job runs queued jobs meanwhile, so
+// jobs may wait for jobs they submit.
+class ThreadPool {
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<std::shared_ptr<Job>> jobs;
+	};
+
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> workers;
+	std::atomic<size_t> queued = 0;
+	std::atomic<size_t> nextQueue = 0;
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+	bool stopping = false;
+
+	std::shared_ptr<Job> take();
+	void execute(Job& job);
+	void work(size_t index);
+
+public:
+	explicit ThreadPool(size_t threads);
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// The pool every interpreter of the process submits to.
+	static ThreadPool& shared();
+
+	size_t size() const {
+		return workers.size();
+	}
+
+	void submit(std::shared_ptr<Job> job);
+	void helpUntil(const std::function<bool()>& finished);
+	void wait(Job& job) {
+		helpUntil([&job] { return job.done.load(std::memory_order_acquire); });
+	}
+};
+
+// Applies a function in a task interpreter, a child of the one that
+// submitted it. The task may read anything the parent can reach but may
+// only mutate what it allocated itself; its result is copied into the
+// parent's heap when the parent collects it.
+class Task : public Job {
+private:
+	Interpreter& parent;
+	gc::Heap* parentHeap;
+	// The parent's objects the body was handed, marked by the parent's
+	// collector while the task runs.
+	const std::vector<LObj> roots;
+	std::function<LObj(Interpreter&)> body;
+	// The heap the task allocated in, which holds its result.
+	gc::Heap* heap = nullptr;
+	LObj result;
+	// Objects outside the child heap that the result refers to.
+	std::vector<LObj> borrowed;
+	std::atomic<bool> sealed = false;
+	std::exception_ptr error;
+
+	void seal(gc::Heap* heap);
+
+public:
+	Task(Interpreter& parent, std::vector<LObj> roots, std::function<LObj(Interpreter&)> body);
+	~Task();
+
+	void run() override;
+	// Rethrows the task's error or returns its result copied into the heap
+	// current on the calling thread.
+	LObj collect();
+	// Marks, in the parent's heap, the task's roots and, once the result is
+	// sealed, what it borrows from there.
+	void trace() const;
+};
+
+// The pending result of a task started by `future`.
+class Future : public Base_Object {
+public:
+	static constexpr Type TypeTag = Type::Future;
+	std::shared_ptr<Task> task;
+	LObj value;
+
+	Future(std::shared_ptr<Task> t)
+		: Base_Object(TypeTag), task(std::move(t)) {}
+
+	void trace() const override;
+
+	std::ostream& operator<<(std::ostream& os) const override {
+		os << "<Future>";
+		return os;
+	}
+};
+
+void waitForTasksSlow(gc::Heap* heap);
+
+// Waits until no running task can be reading the current heap. Called
+// before an object is mutated in place: a task may be reading it, and it
+// would see a torn or half-updated value.
+inline void waitForTasks() {
+	gc::Heap* heap = gc::currentHeap();
+	if (gc::isShared(heap))
+		waitForTasksSlow(heap);
+}
+
+LObj parallelMap(LObj fn, LObj list);
+LObj parallelReduce(LObj fn, LObj init, LObj list);
+LObj spawnFuture(LObj thunk);
+LObj touchFuture(Future& future);
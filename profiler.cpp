@@ -0,0 +1,147 @@
+#include "profiler.hpp"
+#include "vm.hpp"
+#include <algorithm>
+#include <iomanip>
+
+namespace {
+	double milliseconds(std::chrono::steady_clock::duration d) {
+		return std::chrono::duration<double, std::milli>(d).count();
+	}
+}
+
+uint32_t Profiler::entryFor(const Base_Object* key, const char* name) {
+	auto [it, inserted] = entryIndex.try_emplace(key, static_cast<uint32_t>(entries.size()));
+	if (inserted) {
+		entries.emplace_back();
+		entries.back().name = name;
+		entries.back().key = key;
+	}
+	return it->second;
+}
+
+uint32_t Profiler::childNode(uint32_t parent, uint32_t entry) {
+	uint64_t key = static_cast<uint64_t>(parent) << 32 | entry;
+	auto [it, inserted] = childIndex.try_emplace(key, static_cast<uint32_t>(nodes.size()));
+	if (inserted)
+		nodes.push_back({ parent, entry });
+	return it->second;
+}
+
+std::string Profiler::stackName(uint32_t node) const {
+	std::vector<uint32_t> path;
+	for (; node != 0; node = nodes[node].parent)
+		path.push_back(node);
+	std::string name;
+	for (size_t i = path.size(); i-- > 0;) {
+		name += entries[nodes[path[i]].entry].name;
+		if (i != 0) name += ';';
+	}
+	return name;
+}
+
+void Profiler::start() {
+	entries.clear();
+	entryIndex.clear();
+	nodes.assign(1, { 0, 0 });
+	childIndex.clear();
+	stack.clear();
+	running = true;
+}
+
+void Profiler::stop() {
+	unwind(0);
+	running = false;
+}
+
+// Top-level forms are each compiled separately and share one entry.
+uint32_t Profiler::entryFor(const Code* code) {
+	if (code->isToplevel)
+		return entryFor(nullptr, "<toplevel>");
+	return entryFor(code, code->name != nullptr ? code->name->name.c_str() : "<lambda>");
+}
+
+void Profiler::push(uint32_t entry, Clock::time_point start) {
+	++entries[entry].calls;
+	++entries[entry].active;
+	uint32_t parent = stack.empty() ? 0 : stack.back().node;
+	stack.push_back({ entry, childNode(parent, entry), start, {}, gc::allocations() });
+}
+
+// Frames that were already running when the profiler started have no
+// activation, so a pop with an empty stack is ignored.
+void Profiler::pop(Clock::time_point end) {
+	if (stack.empty()) return;
+	Activation a = stack.back();
+	stack.pop_back();
+	Clock::duration elapsed = end - a.start;
+	size_t allocations = gc::allocations() - a.allocations;
+	Entry& e = entries[a.entry];
+	if (--e.active == 0)
+		e.total += elapsed;
+	e.self += elapsed - a.children;
+	e.allocations += allocations - a.childAllocations;
+	nodes[a.node].self += elapsed - a.children;
+	if (!stack.empty()) {
+		stack.back().children += elapsed;
+		stack.back().childAllocations += allocations;
+	}
+}
+
+void Profiler::enter(const Code* code) {
+	push(entryFor(code), Clock::now());
+}
+
+void Profiler::enter(const PredefinedProc* proc) {
+	push(entryFor(proc, proc->name), Clock::now());
+}
+
+void Profiler::leave() {
+	pop(Clock::now());
+}
+
+// The callee's activation starts at the instant the caller's ends, so the
+// bookkeeping in between is charged to the callee rather than left as self
+// time of the caller's caller.
+void Profiler::replace(const Code* code) {
+	Clock::time_point now = Clock::now();
+	pop(now);
+	push(entryFor(code), now);
+}
+
+void Profiler::unwind(size_t depth) {
+	while (stack.size() > depth)
+		leave();
+}
+
+void Profiler::report(std::ostream& os) const {
+	std::vector<const Entry*> sorted;
+	for (const Entry& e : entries)
+		sorted.push_back(&e);
+	std::sort(sorted.begin(), sorted.end(), [](const Entry* a, const Entry* b) {
+		return a->self > b->self;
+		});
+	os << std::setw(12) << "calls" << std::setw(12) << "total ms" << std::setw(12) << "self ms"
+		<< std::setw(12) << "allocs" << "  name" << std::endl;
+	os << std::fixed << std::setprecision(3);
+	for (const Entry* e : sorted) {
+		os << std::setw(12) << e->calls << std::setw(12) << milliseconds(e->total)
+			<< std::setw(12) << milliseconds(e->self) << std::setw(12) << e->allocations
+			<< "  " << e->name << std::endl;
+	}
+	os << std::defaultfloat;
+}
+
+// One "caller;callee count" line per call stack, the count being exclusive
+// microseconds, as read by flamegraph.pl and compatible tools.
+void Profiler::writeCollapsedStacks(std::ostream& os) const {
+	for (uint32_t node = 1; node < nodes.size(); ++node) {
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(nodes[node].self).count();
+		if (us > 0)
+			os << stackName(node) << " " << us << "\n";
+	}
+}
+
+void Profiler::trace() const {
+	for (const Entry& e : entries)
+		gc::mark(const_cast<Base_Object*>(e.key));
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include "lisp.hpp"
+#include <chrono>
+#include <unordered_map>
+
+// Records calls to Lisp procedures and builtins while started: counts,
+// inclusive and exclusive time, and exclusive allocation counts, plus the
+// exclusive time of every distinct call stack for flame graphs. The VM only
+// calls into it when Profiling is set.
+class Profiler {
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct Entry {
+		std::string name;
+		const Base_Object* key;
+		uint64_t calls = 0;
+		uint64_t allocations = 0;
+		Clock::duration total{};
+		Clock::duration self{};
+		size_t active = 0;
+	};
+
+	// One node per distinct call stack; the root is node 0.
+	struct StackNode {
+		uint32_t parent;
+		uint32_t entry;
+		Clock::duration self{};
+	};
+
+	struct Activation {
+		uint32_t entry;
+		uint32_t node;
+		Clock::time_point start;
+		Clock::duration children{};
+		size_t allocations;
+		size_t childAllocations = 0;
+	};
+
+	bool running = false;
+	std::vector<Entry> entries;
+	std::unordered_map<const Base_Object*, uint32_t> entryIndex;
+	std::vector<StackNode> nodes;
+	std::unordered_map<uint64_t, uint32_t> childIndex;
+	std::vector<Activation> stack;
+
+	uint32_t entryFor(const Base_Object* key, const char* name);
+	uint32_t entryFor(const Code* code);
+	void push(uint32_t entry, Clock::time_point start);
+	void pop(Clock::time_point end);
+	uint32_t childNode(uint32_t parent, uint32_t entry);
+	std::string stackName(uint32_t node) const;
+
+public:
+	bool isRunning() const {
+		return running;
+	}
+
+	size_t depth() const {
+		return stack.size();
+	}
+
+	void start();
+	void stop();
+	void enter(const Code* code);
+	void enter(const PredefinedProc* proc);
+	void leave();
+	// A tail call from the innermost activation to `code`.
+	void replace(const Code* code);
+	void unwind(size_t depth);
+	void report(std::ostream& os) const;
+	void writeCollapsedStacks(std::ostream& os) const;
+	void trace() const;
+};
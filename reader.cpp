@@ -0,0 +1,246 @@
+#include "reader.hpp"
+#include "number.hpp"
+
+#if defined(_WIN32)
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	bool isSpace(char c) {
+		return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+	}
+
+	bool isSymbolChar(char c) {
+		return c != '(' && c != ')' && !isSpace(c) && c != 0;
+	}
+
+	bool isDigit(char c) {
+		return '0' <= c && c <= '9';
+	}
+}
+
+void Reader::skipSpace() {
+	while (pos != end) {
+		if (isSpace(*pos)) {
+			++pos;
+		}
+		else if (*pos == ';') {
+			while (pos != end && *pos != '\n' && *pos != '\r') ++pos;
+		}
+		else {
+			break;
+		}
+	}
+}
+
+// Lists are built iteratively: each open list keeps its head and last cell
+// on an explicit stack, so neither nesting depth nor length uses native
+// stack. A `#(` literal is collected the same way and turned into a Vector
+// when it closes.
+LObj Reader::read() {
+	enum class State : uint8_t { Elements, Dot, Dotted, VectorElements };
+	std::vector<LObj> lists;
+	gc::VectorRoot root(lists);
+	std::vector<State> states;
+
+	for (;;) {
+		skipSpace();
+		if (pos == end) throw "Parser contains errors";
+		char c = *pos;
+		LObj value;
+		if (c == '(' || (c == '#' && pos + 1 != end && pos[1] == '(')) {
+			pos += c == '(' ? 1 : 2;
+			lists.push_back(LObj());
+			lists.push_back(LObj());
+			states.push_back(c == '(' ? State::Elements : State::VectorElements);
+			continue;
+		}
+		if (!states.empty() && c == ')') {
+			++pos;
+			if (states.back() == State::Dot)
+				throw "Parser contains errors";
+			value = lists[lists.size() - 2];
+			if (value == nullptr)
+				value = LObj(&Symbols::Null);
+			if (states.back() == State::VectorElements)
+				value = makeObj<Vector>(listToVector(value));
+			lists.resize(lists.size() - 2);
+			states.pop_back();
+		}
+		else if (!states.empty() && states.back() == State::Dotted) {
+			throw "Parser contains errors";
+		}
+		else if (!states.empty() && c == '.' && states.back() == State::Elements && !(pos + 1 != end && isDigit(pos[1]))) {
+			++pos;
+			states.back() = State::Dot;
+			continue;
+		}
+		else if (c == '"') {
+			++pos;
+			value = readString();
+		}
+		else {
+			value = readAtom();
+		}
+
+		if (states.empty())
+			return value;
+		LObj& head = lists[lists.size() - 2];
+		LObj& tail = lists[lists.size() - 1];
+		if (states.back() == State::Dot) {
+			if (tail == nullptr)
+				head = value;
+			else
+				tail.getAs<Cons>().cdr = value;
+			states.back() = State::Dotted;
+			continue;
+		}
+		LObj cell = makeObj<Cons>(value, LObj(&Symbols::Null));
+		if (tail == nullptr)
+			head = cell;
+		else
+			tail.getAs<Cons>().cdr = cell;
+		tail = cell;
+	}
+}
+
+LObj Reader::readString() {
+	const char* start = pos;
+	while (pos != end && *pos != '"' && *pos != '\\') ++pos;
+	if (pos == end)
+		throw "Parser contains errors";
+	if (*pos == '"')
+		return makeObj<String>(std::string(start, pos++));
+
+	std::string value(start, pos);
+	while (pos != end && *pos != '"') {
+		char c = *pos++;
+		if (c == '\\') {
+			if (pos == end) break;
+			switch (c = *pos++) {
+			case 'n': c = '\n'; break;
+			case 'f': c = '\f'; break;
+			case 'b': c = '\b'; break;
+			case 'r': c = '\r'; break;
+			case 't': c = '\t'; break;
+			case '\n': case '\r': c = 0; break;
+			}
+		}
+		if (c != 0)
+			value += c;
+	}
+	if (pos == end)
+		throw "Parser contains errors";
+	++pos;
+	return makeObj<String>(value);
+}
+
+LObj Reader::readAtom() {
+	const char* digits = *pos == '-' ? pos + 1 : pos;
+	if (digits != end && *digits == '.')
+		++digits;
+	if (digits != end && isDigit(*digits)) {
+		return parseNumber(pos, end, pos);
+	}
+	const char* start = pos;
+	while (pos != end && isSymbolChar(*pos)) ++pos;
+	if (pos == start) throw "Parser contains errors";
+	return LObj(symbolTable().intern(std::string_view(start, pos - start)));
+}
+
+#if defined(_WIN32)
+MappedFile::MappedFile(const std::string& path) {
+	std::ifstream ifs(path, std::ios::binary);
+	if (ifs.fail()) return;
+	contents.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+	data = contents.data();
+	size = contents.size();
+	open = true;
+}
+
+MappedFile::~MappedFile() {}
+#else
+MappedFile::MappedFile(const std::string& path) {
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) return;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		::close(fd);
+		return;
+	}
+	if (st.st_size > 0) {
+		void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			data = static_cast<const char*>(p);
+			size = st.st_size;
+			mapped = true;
+		}
+	}
+	::close(fd);
+	open = mapped || st.st_size == 0;
+}
+
+MappedFile::~MappedFile() {
+	if (mapped)
+		munmap(const_cast<char*>(data), size);
+}
+#endif
+
+bool readDatumText(std::istream& is, std::string& text) {
+	text.clear();
+	int c;
+	while ((c = is.get()) != EOF) {
+		if (c == ';') {
+			while (c != EOF && c != '\n' && c != '\r') c = is.get();
+		}
+		else if (!isSpace(static_cast<char>(c))) {
+			break;
+		}
+	}
+	if (c == EOF) return false;
+	text += static_cast<char>(c);
+
+	if (c == '#' && is.peek() == '(') {
+		c = is.get();
+		text += static_cast<char>(c);
+	}
+	if (c != '(' && c != '"') {
+		while ((c = is.peek()) != EOF && isSymbolChar(static_cast<char>(c)))
+			text += static_cast<char>(is.get());
+		return true;
+	}
+
+	int depth = c == '(' ? 1 : 0;
+	bool inString = c == '"';
+	while (depth > 0 || inString) {
+		if ((c = is.get()) == EOF) return true;
+		text += static_cast<char>(c);
+		if (inString) {
+			if (c == '\\') {
+				if ((c = is.get()) == EOF) return true;
+				text += static_cast<char>(c);
+			}
+			else if (c == '"') {
+				inString = false;
+			}
+		}
+		else if (c == '"') {
+			inString = true;
+		}
+		else if (c == ';') {
+			while ((c = is.peek()) != EOF && c != '\n' && c != '\r') is.get();
+		}
+		else if (c == '(') {
+			++depth;
+		}
+		else if (c == ')') {
+			--depth;
+		}
+	}
+	return true;
+}
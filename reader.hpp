@@ -0,0 +1,53 @@
+#pragma once
+#include "lisp.hpp"
+
+// Parses s-expressions straight out of a character buffer; symbols are
+// interned from the buffer and nothing is copied except string literals.
+class Reader {
+private:
+	const char* pos;
+	const char* end;
+
+	void skipSpace();
+	LObj readString();
+	LObj readAtom();
+
+public:
+	explicit Reader(std::string_view source)
+		: pos(source.data()), end(source.data() + source.size()) {}
+
+	bool atEnd() {
+		skipSpace();
+		return pos == end;
+	}
+
+	LObj read();
+};
+
+// A whole file as one read-only buffer, memory-mapped where available.
+class MappedFile {
+private:
+	const char* data = nullptr;
+	size_t size = 0;
+	bool mapped = false;
+	bool open = false;
+	std::string contents;
+
+public:
+	explicit MappedFile(const std::string& path);
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool isOpen() const {
+		return open;
+	}
+
+	std::string_view view() const {
+		return std::string_view(data, size);
+	}
+};
+
+// Collects the text of the next datum from an interactive stream, so that
+// it can be handed to a Reader. Returns false at end of input.
+bool readDatumText(std::istream& is, std::string& text);
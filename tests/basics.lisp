@@ -0,0 +1,20 @@
+; Evaluation of the special forms.
+
+(define square (lambda (x) (* x x)))
+(check "define and call" (square 12) 144)
+(check "if" (if (< 1 2) (quote yes) (quote no)) (quote yes))
+(check "if without else" (if (< 2 1) 1) (quote ()))
+(check "let" (let (a 1 b 2) (+ a b)) 3)
+(check "let*" (let* (a 1 b (+ a 1)) (* a b)) 2)
+(check "do" (do 1 2 3) 3)
+
+(define counter 0)
+(define bump (lambda () (set! counter (+ counter 1))))
+(bump)
+(bump)
+(check "set! of a global" counter 2)
+
+(define make-adder (lambda (n) (lambda (x) (+ x n))))
+(check "closure" ((make-adder 10) 5) 15)
+(define rest-args (lambda (a . more) more))
+(check "rest parameter" (rest-args 1 2 3) (quote (2 3)))
@@ -0,0 +1,22 @@
+; Loaded ahead of every test script. A failed check prints a FAIL line,
+; which ctest treats as a failure, and an uncaught error ends the run with
+; a non-zero status.
+
+; Predicates answer t or f, and only () is false to `if`, so an answer is
+; turned into t or () before branching on it.
+(define truths (make-hash-table))
+(hash-set! truths (quote t) t)
+(define true? (lambda (answer) (hash-ref truths answer)))
+
+(define check (lambda (name got want)
+  (if (true? (equal? got want))
+    t
+    (do (print "FAIL " name ": got " got ", want " want)
+        (println "")))))
+
+; The value of one entry of (heap-stats).
+(define heap-stat (lambda (name) (assq-value name (heap-stats))))
+(define assq-value (lambda (key alist)
+  (if (true? (eq? (car (car alist)) key))
+    (cdr (car alist))
+    (assq-value key (cdr alist)))))
@@ -0,0 +1,24 @@
+; Calls and constant pools beyond 16-bit operand limits.
+
+(define count-args (lambda args (vector-length (list->vector args))))
+(define iota (lambda (n acc) (if (= n 0) acc (iota (- n 1) (cons n acc)))))
+
+(check "call with 100000 arguments"
+  (eval (cons (quote count-args) (iota 100000 (quote ()))))
+  100000)
+
+(define last (lambda (l) (if (cdr l) (last (cdr l)) (car l))))
+(define last-arg (lambda args (last args)))
+(check "constant past index 65535"
+  (eval (cons (quote last-arg) (iota 70000 (quote ()))))
+  70000)
+
+(check "global past index 65535"
+  (eval (cons (quote last-arg) (iota 70000 (cons (quote last-arg) (quote ())))))
+  last-arg)
+
+; Slots stay 16 bit; the compiler refuses to wrap them.
+(check "70000 parameters" (load "too-many-parameters.lisp") ())
+(check "no lambda with 70000 parameters" (true? (bound? (quote too-many-parameters))) ())
+(check "70000 locals" (load "too-many-locals.lisp") ())
+(check "no let with 70000 locals" (true? (bound? (quote too-many-locals))) ())
@@ -0,0 +1,2 @@
+; Loaded by tests/hash-tables.lisp: far larger than a table may be.
+(define huge-table (make-hash-table 1000000000000))
@@ -0,0 +1,2 @@
+; Loaded by tests/basics.lisp: far larger than a vector may be.
+(define huge-vector (make-vector 1000000000000))
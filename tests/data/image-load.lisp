@@ -0,0 +1,15 @@
+; Run by the images-load test, in an interpreter started from the image
+; that tests/images.lisp saves.
+
+(check "string" image-string "text")
+(check "bignum" image-bignum 100000000000000000000)
+(check "float" image-float 2.5)
+(check "list" image-list (cons 1 (cons (quote two) (cons "three" ()))))
+(check "vector" (vector-ref image-vector 2) 3)
+(check "string key" (hash-ref image-table "key") (quote value))
+(check "list key" (hash-ref image-table (cons 1 (cons 2 ()))) 12)
+(check "sharing is kept" (true? (eq? (car image-shared) (cdr image-shared))) t)
+(check "closure state" (image-counter) 12)
+(check "wide function" (image-wide) 70001)
+(check "macro" (image-unless () 5) 5)
+(check "builtins still open-coded" (+ 1 2) 3)
@@ -0,0 +1,5 @@
+; Compiled by tests/fasl.lisp.
+(define module-offset 10)
+(define module-add (lambda (x) (+ x module-offset)))
+(define module-counter (lambda (count)
+  (lambda () (set! count (+ count 1)))))
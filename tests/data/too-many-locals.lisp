@@ -0,0 +1,5 @@
+; Loaded by tests/compiler.lisp: a let of 70000 variables, past the 16-bit
+; slot operands, must not compile.
+(define bindings (lambda (n acc) (if (= n 0) acc (bindings (- n 1) (cons (gensym) (cons n acc))))))
+(define too-many-locals
+  (eval (cons (quote let) (cons (bindings 70000 ()) (cons 1 ())))))
@@ -0,0 +1,6 @@
+; Loaded by tests/compiler.lisp: a lambda with 70000 parameters, past the
+; 16-bit slot operands, must not compile.
+(define symbols (lambda (n acc) (if (= n 0) acc (symbols (- n 1) (cons (gensym) acc)))))
+(define parameters (symbols 70000 ()))
+(define too-many-parameters
+  (eval (cons (quote lambda) (cons parameters (cons (car parameters) ())))))
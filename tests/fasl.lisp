@@ -0,0 +1,24 @@
+; compile-file and loading .fasl files. The files in tests/data are copied
+; next to this script's working directory by the build.
+
+(check "compile-file" (compile-file "module.lisp") t)
+(define module-offset 0)
+(check "load fasl" (load "module.fasl") t)
+(check "global from fasl" (module-add 5) 15)
+(define next (module-counter 0))
+(next)
+(check "closure from fasl" (next) 2)
+(check "load prefers current fasl" (load "module.lisp") t)
+(check "missing file" (load "no-such-file.lisp") ())
+
+; Both were written from (define answer 42): one with its constant index
+; out of range, one with an unknown opcode. They are rejected on load
+; instead of being run.
+(check "constant index out of range" (load "bad-constant.fasl") ())
+(check "unknown opcode" (load "bad-opcode.fasl") ())
+(check "rejected file defines nothing" (true? (bound? (quote answer))) ())
+
+; A constant count of 2^32 - 1 in a 100-byte file, and a file cut off
+; inside its first record: both fail to read instead of allocating.
+(check "huge count" (load "huge-count.fasl") ())
+(check "truncated file" (load "truncated.fasl") ())
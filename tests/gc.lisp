@@ -0,0 +1,24 @@
+; Structures built across many collections keep their contents.
+
+(define build (lambda (n acc)
+  (if (= n 0) acc (build (- n 1) (cons (cons n (vector n "s")) acc)))))
+(define sum-cars (lambda (l acc)
+  (if l (sum-cars (cdr l) (+ acc (car (car l)))) acc)))
+(define sum-vectors (lambda (l acc)
+  (if l (sum-vectors (cdr l) (+ acc (vector-ref (cdr (car l)) 0))) acc)))
+
+(define kept (build 100000 (quote ())))
+(define churn (lambda (n) (if (= n 0) 0 (do (build 1000 (quote ())) (churn (- n 1))))))
+(define before (heap-stat (quote collections)))
+(churn 200)
+(check "collections ran" (< before (heap-stat (quote collections))) t)
+(check "list survives" (sum-cars kept 0) 5000050000)
+(check "vectors survive" (sum-vectors kept 0) 5000050000)
+(check "strings survive" (vector-ref (cdr (car kept)) 1) "s")
+
+(define table (make-hash-table))
+(define fill (lambda (n) (if (= n 0) 0 (do (hash-set! table n (cons n n)) (fill (- n 1))))))
+(fill 20000)
+(churn 100)
+(check "hash table survives" (hash-ref table 12345) (cons 12345 12345))
+(check "hash table count" (hash-count table) 20000)
@@ -0,0 +1,51 @@
+; Hash tables keyed by equal?.
+
+(define h (make-hash-table))
+(hash-set! h "key" 1)
+(hash-set! h (quote (1 2)) 2)
+(hash-set! h 1.5 3)
+(hash-set! h 100000000000000000000 4)
+(check "string key" (hash-ref h "key") 1)
+(check "list key is structural" (hash-ref h (cons 1 (cons 2 (quote ())))) 2)
+(check "float key" (hash-ref h 1.5) 3)
+(check "bignum key" (hash-ref h 100000000000000000000) 4)
+(check "missing key default" (hash-ref h 9 (quote none)) (quote none))
+(check "missing key" (hash-ref h 9) ())
+(hash-set! h "key" 10)
+(check "overwrite" (hash-ref h "key") 10)
+(check "count" (hash-count h) 4)
+(hash-remove! h "key")
+(check "remove" (hash-ref h "key") ())
+(check "count after remove" (hash-count h) 3)
+
+(define sum 0)
+(hash-for-each h (lambda (k v) (set! sum (+ sum v))))
+(check "for-each visits every entry" sum 9)
+(check "keys" (vector-length (list->vector (hash-keys h))) 3)
+
+(define big (make-hash-table))
+(define fill (lambda (i n) (if (= i n) 0 (do (hash-set! big i (* i i)) (fill (+ i 1) n)))))
+(define drop (lambda (i n) (if (< i n) (do (hash-remove! big i) (drop (+ i 2) n)) 0)))
+(fill 0 100000)
+(drop 0 100000)
+(check "grows" (hash-count big) 50000)
+(check "lookup after growth and removal" (hash-ref big 99999) 9999800001)
+(check "removed stays removed" (hash-ref big 50000) ())
+
+; As for make-vector, a huge size is an error rather than a failed
+; allocation.
+(check "huge table" (load "huge-hash-table.lisp") ())
+(check "no huge table" (true? (bound? (quote huge-table))) ())
+
+; equal? on floats agrees with their hash: NaN is only equal to NaN, and
+; 0.0 and -0.0 are one key.
+(define nan (- 1e400 1e400))
+(check "NaN is not equal to a number" (true? (equal? nan 1.0)) ())
+(check "NaN is equal to NaN" (true? (equal? nan (- 1e400 1e400))) t)
+(define floats (make-hash-table))
+(hash-set! floats 1.0 (quote one))
+(hash-set! floats nan (quote nan))
+(hash-set! floats 0.0 (quote zero))
+(check "NaN key" (hash-ref floats (- 1e400 1e400)) (quote nan))
+(check "NaN key leaves 1.0 alone" (hash-ref floats 1.0) (quote one))
+(check "-0.0 finds 0.0" (hash-ref floats -0.0) (quote zero))
@@ -0,0 +1,24 @@
+; save-image writes every global; tests/data/image-load.lisp checks them
+; in a fresh interpreter started with --image images.img.
+
+(define image-string "text")
+(define image-bignum 100000000000000000000)
+(define image-float 2.5)
+(define image-list (cons 1 (cons (quote two) (cons "three" ()))))
+(define image-vector (vector 1 2 3))
+(define image-table (make-hash-table))
+(hash-set! image-table "key" (quote value))
+(hash-set! image-table (quote (1 2)) 12)
+(define image-shared (cons image-list image-list))
+(define make-counter (lambda (count) (lambda () (set! count (+ count 1)))))
+(define image-counter (make-counter 10))
+(image-counter)
+(define image-unless (macro (c body) (cons (quote if) (cons c (cons () (cons body ()))))))
+
+; Wide enough that an open-coded call's fallback slot is past 65535.
+(define count-args (lambda args (vector-length (list->vector args))))
+(define iota (lambda (n acc) (if (= n 0) acc (iota (- n 1) (cons n acc)))))
+(define image-wide (eval (cons (quote lambda) (cons ()
+  (cons (cons (quote count-args) (iota 70000 (cons (quote (+ 1 2)) ()))) ())))))
+
+(check "save-image" (save-image "images.img") t)
@@ -0,0 +1,24 @@
+; Fixnums, bignums and floats.
+
+(define fixnum-max 4611686018427387903)
+(check "fixnum overflow promotes" (+ fixnum-max 1) 4611686018427387904)
+(check "negative overflow" (- (- 0 fixnum-max) 2) -4611686018427387905)
+(check "bignum product"
+  (* 4611686018427387904 4611686018427387904)
+  21267647932558653966460912964485513216)
+(check "bignum back to fixnum" (- (+ fixnum-max 1) 1) fixnum-max)
+(check "bignum is an integer" (int? (+ fixnum-max 1)) t)
+(check "bignum division" (/ 100000000000000000000 10) 10000000000000000000)
+(define factorial (lambda (n acc) (if (= n 0) acc (factorial (- n 1) (* acc n)))))
+(check "factorial 25" (factorial 25 1) 15511210043330985984000000)
+
+(check "integer division truncates" (/ 7 2) 3)
+(check "mod" (mod 7 3) 1)
+(check "mod keeps the dividend's sign" (mod -7 3) -1)
+(check "float contagion" (+ 1 2.5) 3.5)
+(check "float division" (/ 7.0 2) 3.5)
+(check "float product" (* 1.5 2) 3.0)
+(check "mixed comparison" (< 1 2.5) t)
+(check "mixed equality" (= 2 2.0) t)
+(check "bignum comparison" (< fixnum-max (+ fixnum-max 1)) t)
+(check "float predicate" (float? 1.5) t)
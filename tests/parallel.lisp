@@ -0,0 +1,54 @@
+; pmap, parallel-reduce and futures.
+
+(define range (lambda (i n) (if (= i n) () (cons i (range (+ i 1) n)))))
+(define items (range 0 1000))
+
+(check "reduce adds init once" (parallel-reduce + 100 items) 499600)
+(check "reduce with zero init" (parallel-reduce + 0 items) 499500)
+(check "reduce one item" (parallel-reduce + 100 (cons 5 ())) 105)
+(check "reduce empty list" (parallel-reduce + 100 ()) 100)
+(check "reduce keeps order" (parallel-reduce - 0 (range 1 5)) -10)
+
+(define sum (lambda (list) (if (true? (null? list)) 0 (+ (car list) (sum (cdr list))))))
+(check "pmap" (sum (pmap (lambda (x) (* x 2)) items)) 999000)
+(check "pmap keeps order" (car (cdr (cdr (pmap (lambda (x) (* x x)) items)))) 4)
+
+(check "future" (touch (future (+ 1 2))) 3)
+(define f (future (sum items)))
+(check "touch twice" (+ (touch f) (touch f)) 999000)
+
+; Tasks read globals while this interpreter keeps rebinding one.
+(define counter 0)
+(define read-counter (lambda (i n) (if (= i n) counter (do counter (read-counter (+ i 1) n)))))
+(define readers (pmap (lambda (x) (read-counter 0 1000)) (range 0 16)))
+(define reader (future (read-counter 0 100000)))
+(define bump (lambda (i n) (if (= i n) 0 (do (set! counter (+ counter 1)) (bump (+ i 1) n)))))
+(bump 0 10000)
+(touch reader)
+(check "parent writes while tasks read" counter 10000)
+
+; In-place mutation waits for the tasks that may be reading the object.
+(define shared (make-vector 4 1))
+(define count-changed (lambda (i n changed)
+  (if (= i n) changed
+    (count-changed (+ i 1) n (if (true? (= (vector-ref shared 0) 1)) changed (+ changed 1))))))
+(define watcher (future (count-changed 0 300000 0)))
+(vector-set! shared 0 2)
+(check "vector-set! waits for readers" (touch watcher) 0)
+(check "vector-set! applies after them" (vector-ref shared 0) 2)
+
+; The parent keeps collecting while a task runs, without freeing what the
+; task was handed.
+(define churn (lambda (n) (if (= n 0) 0 (do (range 0 10000) (churn (- n 1))))))
+(define collections-before (heap-stat (quote collections)))
+(define summer (let (numbers (range 0 1000))
+  (future (do (read-counter 0 2000000) (sum numbers)))))
+(churn 200)
+(check "parent collects while a task runs" (< collections-before (heap-stat (quote collections))) t)
+(check "task roots survive" (touch summer) 499500)
+(check "parent heap stays small" (< (heap-stat (quote peak-heap-bytes)) 32000000) t)
+
+; Pooled task interpreters start clean each time.
+(define pmap-sums (lambda (n acc)
+  (if (= n 0) acc (pmap-sums (- n 1) (+ acc (sum (pmap (lambda (x) (+ x n)) items)))))))
+(check "repeated pmap" (pmap-sums 50 0) 26250000)
@@ -0,0 +1,14 @@
+; Reading numbers and dotted pairs.
+
+(check "integer" (+ 12 -3) 9)
+(check "float" 2.5 (+ 2 .5))
+(check "leading dot" (+ .5 .25) 0.75)
+(check "negative leading dot" -.5 (- 0 0.5))
+(check "exponent" 1.5e3 1500.0)
+(check "too large a float is infinity" (< 1e308 1e400) t)
+(check "negative infinity" (< -1e400 -1e308) t)
+(check "too small a float is zero" 1e-400 0.0)
+(check "bignum literal" (- 100000000000000000000 99999999999999999999) 1)
+(check "dotted pair" (cdr (quote (a . b))) (quote b))
+(check "dot before a digit is a number" (cdr (quote (a .5))) (quote (0.5)))
+(check "vector of floats" (vector-ref (quote #(1 .5)) 1) 0.5)
@@ -0,0 +1,23 @@
+; Tail calls run in constant stack and heap.
+
+(define count-down (lambda (n) (if (= n 0) (quote done) (count-down (- n 1)))))
+(check "tail loop" (count-down 1000000) (quote done))
+
+(define even-odd (lambda (n even) (if (= n 0) even (even-odd (- n 1) (if even () t)))))
+(check "tail call through if" (even-odd 100001 t) ())
+
+; A global named like a parameter makes the parameter special, bound in a
+; dynamic Env for every call.
+(define n 5)
+(define loop (lambda (n acc) (if (= n 0) acc (loop (- n 1) (+ acc 1)))))
+(check "tail loop over a special parameter" (loop 2000000 0) 2000000)
+(check "special tail loop keeps the heap small"
+  (< (heap-stat (quote peak-heap-bytes)) 64000000) t)
+(check "global is unchanged" n 5)
+
+; The callee of a tail call still sees the caller's special bindings.
+(define show-n (lambda () n))
+(define with-n (lambda (n) (show-n)))
+(check "tail callee sees caller's binding" (with-n 42) 42)
+(define nested (lambda (n k) (if (= k 0) (show-n) (nested (+ n 1) (- k 1)))))
+(check "innermost binding wins" (nested 0 10) 10)
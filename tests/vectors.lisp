@@ -0,0 +1,16 @@
+; Vectors.
+
+(define v (make-vector 3 0))
+(vector-set! v 1 5)
+(check "make-vector fill" (vector-ref v 0) 0)
+(check "vector-set!" (vector-ref v 1) 5)
+(check "vector-length" (vector-length v) 3)
+(check "make-vector without fill" (vector-ref (make-vector 1) 0) ())
+(check "empty vector" (vector-length (make-vector 0)) 0)
+(check "vector->list" (vector->list (vector 1 2 3)) (quote (1 2 3)))
+(check "list->vector" (vector-ref (list->vector (quote (a b c))) 2) (quote c))
+
+; Asking for a trillion slots is an error from make-vector, which load
+; reports, rather than an allocation failure that ends the process.
+(check "huge vector" (load "huge-vector.lisp") ())
+(check "no huge vector" (true? (bound? (quote huge-vector))) ())
@@ -0,0 +1,1183 @@
+#include "vm.hpp"
+#include "number.hpp"
+#include "parallel.hpp"
+#include "profiler.hpp"
+#include <algorithm>
+#include <cstring>
+#include <optional>
+#include <set>
+#include <unordered_map>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define VM_COMPUTED_GOTO 1
+#endif
+
+namespace {
+	enum class Operand : uint8_t {
+		None,
+		Index,
+		Slot,
+		SlotIndex,
+		SlotField,
+		Address,
+		Target,
+		Count
+	};
+
+	constexpr Operand OperandKinds[] = {
+#define VM_OPERAND(name, operand) Operand::operand,
+		VM_OPCODES(VM_OPERAND)
+#undef VM_OPERAND
+	};
+
+	constexpr const char* OpNames[] = {
+#define VM_NAME(name, operand) #name,
+		VM_OPCODES(VM_NAME)
+#undef VM_NAME
+	};
+
+	inline uint16_t read16(const uint8_t* p) {
+		return static_cast<uint16_t>(p[0] | p[1] << 8);
+	}
+
+	inline uint32_t read32(const uint8_t* p) {
+		uint32_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	[[noreturn]] void unresolvable(const Symbol* symbol) {
+		std::cerr << "Unresolvable symbol: " << symbol->name << '\n';
+		throw "Evaluated unresolvable symbol";
+	}
+
+	// Builtins whose calls are open-coded when they have this many
+	// arguments.
+	struct Intrinsic {
+		const char* name;
+		size_t argc;
+		Op op;
+	};
+
+	constexpr Intrinsic Intrinsics[] = {
+		{ "+", 2, Op::Add },
+		{ "-", 2, Op::Sub },
+		{ "*", 2, Op::Mul },
+		{ "<", 2, Op::Less },
+		{ "=", 2, Op::NumEq },
+		{ "car", 1, Op::Car },
+		{ "cdr", 1, Op::Cdr },
+		{ "cons", 2, Op::MakeCons },
+		{ "null?", 1, Op::IsNull },
+	};
+
+	bool findIntrinsic(const Symbol* symbol, size_t argc, Op& op) {
+		if (symbol->rebound || symbol->dynamic || !symbol->value.load(std::memory_order_acquire).typep<PredefinedProc>())
+			return false;
+		for (const Intrinsic& intrinsic : Intrinsics) {
+			if (intrinsic.argc == argc && symbol->name == intrinsic.name) {
+				op = intrinsic.op;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// A lexical variable: either a stack slot or, when captured, an index
+	// into the `frame`th Frame pushed by this function.
+	struct LocalBinding {
+		Symbol* symbol;
+		BindingKind kind;
+		uint16_t slot;
+		uint16_t frame;
+	};
+
+	class Compiler {
+	private:
+		Code* code;
+		Compiler* enclosing;
+		std::vector<LocalBinding> scope;
+		std::unordered_map<LObj, size_t, LObj::IdentityHash> constantIndex;
+		uint16_t nextSlot = 0;
+		uint16_t frameCount = 0;
+		uint16_t frameSize = 0;
+		int depth = 0;
+
+		void emit(Op op, int stackEffect) {
+			code->bytecode.push_back(static_cast<uint8_t>(op));
+			depth += stackEffect;
+			if (depth > static_cast<int>(code->maxStack))
+				code->maxStack = static_cast<uint32_t>(depth);
+		}
+
+		void emit16(size_t v) {
+			if (v > UINT16_MAX)
+				throw "Function too large to compile";
+			code->bytecode.push_back(static_cast<uint8_t>(v));
+			code->bytecode.push_back(static_cast<uint8_t>(v >> 8));
+		}
+
+		void emit32(size_t v) {
+			if (v > UINT32_MAX)
+				throw "Function too large to compile";
+			uint32_t u = static_cast<uint32_t>(v);
+			size_t at = code->bytecode.size();
+			code->bytecode.resize(at + sizeof(u));
+			std::memcpy(&code->bytecode[at], &u, sizeof(u));
+		}
+
+		size_t emitJump(Op op, int stackEffect) {
+			emit(op, stackEffect);
+			size_t at = code->bytecode.size();
+			code->bytecode.resize(at + sizeof(uint32_t));
+			return at;
+		}
+
+		void patch(size_t at) {
+			uint32_t target = static_cast<uint32_t>(code->bytecode.size());
+			std::memcpy(&code->bytecode[at], &target, sizeof(target));
+		}
+
+		size_t constant(LObj value) {
+			auto [it, added] = constantIndex.emplace(value, code->constants.size());
+			if (added)
+				code->constants.push_back(value);
+			return it->second;
+		}
+
+		uint16_t allocateSlot(Symbol* symbol) {
+			if (nextSlot == UINT16_MAX)
+				throw "Function too large to compile";
+			uint16_t slot = nextSlot++;
+			if (nextSlot > code->localCount) {
+				code->localCount = nextSlot;
+				code->slotNames.resize(nextSlot);
+			}
+			code->slotNames[slot] = symbol;
+			return slot;
+		}
+
+		const LocalBinding* findLocal(Symbol* symbol) const {
+			for (size_t i = scope.size(); i-- > 0;) {
+				if (scope[i].symbol == symbol)
+					return &scope[i];
+			}
+			return nullptr;
+		}
+
+		void bindVariable(Symbol* symbol, BindingKind kind, uint16_t slot) {
+			if (kind == BindingKind::Special) {
+				emit(Op::BindSpecial, 0);
+				emit16(slot);
+				emit32(constant(symbol));
+				return;
+			}
+			if (kind == BindingKind::Captured) {
+				emit(Op::BindEnv, 0);
+				emit16(slot);
+				emit16(frameSize);
+				scope.push_back({ symbol, kind, frameSize++, static_cast<uint16_t>(frameCount - 1) });
+				return;
+			}
+			scope.push_back({ symbol, kind, slot, 0 });
+		}
+
+		void pushFrame(const std::vector<BindingKind>& kinds) {
+			size_t captured = std::count(kinds.begin(), kinds.end(), BindingKind::Captured);
+			if (captured > UINT16_MAX)
+				throw "Function too large to compile";
+			emit(Op::PushEnv, 0);
+			emit32(captured);
+			if (frameCount == UINT16_MAX)
+				throw "Function too large to compile";
+			++frameCount;
+			frameSize = 0;
+		}
+
+		// Emits a LoadEnv or StoreEnv addressing the captured variable
+		// `symbol` by the number of Frames to walk up and its index there.
+		void emitAddress(Op op, int stackEffect, Symbol* symbol) {
+			size_t frameDepth = 0;
+			for (Compiler* c = this; c != nullptr; c = c->enclosing) {
+				const LocalBinding* local = c->findLocal(symbol);
+				if (local != nullptr && local->kind == BindingKind::Captured) {
+					emit(op, stackEffect);
+					emit16(frameDepth + c->frameCount - 1 - local->frame);
+					emit16(local->slot);
+					emit32(constant(symbol));
+					return;
+				}
+				frameDepth += c->frameCount;
+			}
+			throw "Wrong usage";
+		}
+
+		static bool hasKind(const std::vector<BindingKind>& kinds, BindingKind kind) {
+			return std::find(kinds.begin(), kinds.end(), kind) != kinds.end();
+		}
+
+		void compileLet(const Let& let, bool tail) {
+			size_t scopeSize = scope.size();
+			uint16_t slotMark = nextSlot;
+			uint16_t sizeMark = frameSize;
+			bool captures = hasKind(let.kinds, BindingKind::Captured);
+			bool specials = hasKind(let.kinds, BindingKind::Special);
+			std::vector<uint16_t> slots;
+			if (let.sequential) {
+				if (captures) pushFrame(let.kinds);
+				if (specials) emit(Op::PushDynamic, 0);
+			}
+			for (size_t i = 0; i < let.symbols.size(); ++i) {
+				compileNode(let.inits[i]);
+				slots.push_back(allocateSlot(let.symbols[i]));
+				emit(Op::PopLocal, -1);
+				emit16(slots.back());
+				if (let.sequential)
+					bindVariable(let.symbols[i], let.kinds[i], slots.back());
+			}
+			if (!let.sequential) {
+				if (captures) pushFrame(let.kinds);
+				if (specials) emit(Op::PushDynamic, 0);
+				for (size_t i = 0; i < let.symbols.size(); ++i)
+					bindVariable(let.symbols[i], let.kinds[i], slots[i]);
+			}
+			compileNode(let.body, tail);
+			scope.resize(scopeSize);
+			nextSlot = slotMark;
+			if (specials) emit(Op::PopDynamic, 0);
+			if (captures) {
+				emit(Op::PopEnv, 0);
+				--frameCount;
+				frameSize = sizeMark;
+			}
+		}
+
+		// `tail` is set when the value of `node` is returned from the function
+		// being compiled, so calls there can replace the caller's frame.
+		void compileNode(Node* node, bool tail = false) {
+			if (node->typep<Const>()) {
+				emit(Op::Const, 1);
+				emit32(constant(node->getAs<Const>().value));
+			}
+			else if (node->typep<LocalRef>()) {
+				Symbol* symbol = node->getAs<LocalRef>().symbol;
+				const LocalBinding* local = findLocal(symbol);
+				if (local != nullptr && local->kind == BindingKind::Local) {
+					emit(Op::LoadLocal, 1);
+					emit16(local->slot);
+				}
+				else {
+					emitAddress(Op::LoadEnv, 1, symbol);
+				}
+			}
+			else if (node->typep<GlobalRef>()) {
+				emit(Op::LoadGlobal, 1);
+				emit32(constant(node->getAs<GlobalRef>().symbol));
+			}
+			else if (node->typep<If>()) {
+				If& n = node->getAs<If>();
+				compileNode(n.cond);
+				size_t otherwise = emitJump(Op::JumpIfNull, -1);
+				compileNode(n.then, tail);
+				size_t end = emitJump(Op::Jump, -1);
+				patch(otherwise);
+				if (n.otherwise != nullptr)
+					compileNode(n.otherwise, tail);
+				else
+					emit(Op::Nil, 1);
+				patch(end);
+			}
+			else if (node->typep<Seq>()) {
+				const std::vector<Node*>& body = node->getAs<Seq>().body;
+				if (body.empty())
+					emit(Op::Nil, 1);
+				for (size_t i = 0; i < body.size(); ++i) {
+					compileNode(body[i], tail && i + 1 == body.size());
+					if (i + 1 < body.size())
+						emit(Op::Pop, -1);
+				}
+			}
+			else if (node->typep<Define>()) {
+				Define& n = node->getAs<Define>();
+				compileNode(n.value);
+				emit(Op::Define, 0);
+				emit32(constant(n.symbol));
+			}
+			else if (node->typep<Set>()) {
+				Set& n = node->getAs<Set>();
+				compileNode(n.value);
+				const LocalBinding* local = n.local ? findLocal(n.symbol) : nullptr;
+				if (local != nullptr && local->kind == BindingKind::Local) {
+					emit(Op::StoreLocal, 0);
+					emit16(local->slot);
+				}
+				else if (n.local) {
+					emitAddress(Op::StoreEnv, 0, n.symbol);
+				}
+				else {
+					emit(Op::StoreGlobal, 0);
+					emit32(constant(n.symbol));
+				}
+			}
+			else if (node->typep<Let>()) {
+				compileLet(node->getAs<Let>(), tail);
+			}
+			else if (node->typep<Lambda>()) {
+				Compiler inner(node->getAs<Lambda>(), this);
+				emit(Op::Closure, 1);
+				emit32(constant(inner.code));
+			}
+			else if (node->typep<Call>()) {
+				Call& n = node->getAs<Call>();
+				Op op;
+				if (n.function->typep<GlobalRef>() &&
+					findIntrinsic(n.function->getAs<GlobalRef>().symbol, n.args.size(), op)) {
+					for (Node* arg : n.args)
+						compileNode(arg);
+					// The fallback call needs one more slot, for the function.
+					if (depth + 1 > static_cast<int>(code->maxStack))
+						code->maxStack = static_cast<uint32_t>(depth + 1);
+					emit(op, 1 - static_cast<int>(n.args.size()));
+					emit32(constant(LObj(n.function->getAs<GlobalRef>().symbol)));
+					return;
+				}
+				compileNode(n.function);
+				for (Node* arg : n.args)
+					compileNode(arg);
+				emit(tail && TailCallOptimisation ? Op::TailCall : Op::Call, -static_cast<int>(n.args.size()));
+				emit32(n.args.size());
+			}
+			else {
+				throw "Wrong usage";
+			}
+		}
+
+	public:
+		explicit Compiler(Node* node)
+			: code(gcNew<Code>()), enclosing(nullptr) {
+			code->isToplevel = true;
+			compileNode(node, true);
+			emit(Op::Return, -1);
+		}
+
+		Compiler(const Lambda& lambda, Compiler* outer)
+			: code(gcNew<Code>()), enclosing(outer) {
+			if (lambda.parameters.size() > UINT16_MAX)
+				throw "Function too large to compile";
+			code->parameterCount = static_cast<uint16_t>(lambda.parameters.size());
+			code->hasRest = lambda.rest != nullptr;
+			code->isMacro = lambda.isMacro;
+			std::vector<Symbol*> variables = lambda.parameters;
+			if (lambda.rest != nullptr)
+				variables.push_back(lambda.rest);
+			for (Symbol* variable : variables)
+				allocateSlot(variable);
+			if (hasKind(lambda.kinds, BindingKind::Captured)) pushFrame(lambda.kinds);
+			if (hasKind(lambda.kinds, BindingKind::Special)) emit(Op::PushDynamic, 0);
+			for (size_t i = 0; i < variables.size(); ++i)
+				bindVariable(variables[i], lambda.kinds[i], static_cast<uint16_t>(i));
+			compileNode(lambda.body, true);
+			emit(Op::Return, -1);
+		}
+
+		Code* result() const {
+			return code;
+		}
+	};
+
+	// Bytes of operands that follow an opcode.
+	constexpr size_t operandSize(Operand operand) {
+		switch (operand) {
+		case Operand::None: return 0;
+		case Operand::Slot: return 2;
+		case Operand::SlotIndex: return 6;
+		case Operand::SlotField: return 4;
+		case Operand::Address: return 8;
+		default: return 4;
+		}
+	}
+
+	size_t intrinsicArgc(Op op) {
+		for (const Intrinsic& intrinsic : Intrinsics) {
+			if (intrinsic.op == op)
+				return intrinsic.argc;
+		}
+		throw "Wrong usage";
+	}
+
+	// Checks Code read from a file before the VM, which trusts its operands,
+	// runs it. Every instruction must decode, name an existing slot,
+	// constant of the right type or captured variable, and every path
+	// through it must keep the stack within maxStack and end in Return.
+	// Nested Code is checked where a Closure op creates it, against the
+	// Frames it will close over.
+	class Verifier {
+	private:
+		// What is known before an instruction; paths that meet must agree.
+		struct State {
+			uint32_t depth = 0;
+			std::vector<uint16_t> frames;
+			uint32_t dynamic = 0;
+			bool operator==(const State&) const = default;
+		};
+
+		// Sizes of the Frames a Code closes over, innermost first.
+		using Chain = std::vector<uint16_t>;
+
+		std::set<std::pair<const Code*, Chain>> verified;
+		std::set<const Code*> active;
+
+		static void require(bool ok) {
+			if (!ok)
+				throw "Invalid bytecode in image or compiled file";
+		}
+
+		static const LObj& constantAt(const Code& code, const uint8_t* operand) {
+			uint32_t i = read32(operand);
+			require(i < code.constants.size());
+			return code.constants[i];
+		}
+
+		static void symbolAt(const Code& code, const uint8_t* operand) {
+			require(constantAt(code, operand).isSymbol());
+		}
+
+		static void slotAt(const Code& code, const uint8_t* operand) {
+			require(read16(operand) < code.localCount);
+		}
+
+		static Chain innerChain(const State& state, const Chain& outer) {
+			Chain chain(state.frames.rbegin(), state.frames.rend());
+			chain.insert(chain.end(), outer.begin(), outer.end());
+			return chain;
+		}
+
+		static void addressAt(const Code& code, const uint8_t* operand, const State& state, const Chain& outer) {
+			Chain chain = innerChain(state, outer);
+			uint16_t depth = read16(operand);
+			require(depth < chain.size() && read16(operand + 2) < chain[depth]);
+			symbolAt(code, operand + 4);
+		}
+
+		void verifyBody(const Code& code, const Chain& outer) {
+			require(code.slotNames.size() == code.localCount);
+			for (Symbol* s : code.slotNames)
+				require(s != nullptr);
+			require(code.parameterCount + (code.hasRest ? 1 : 0) <= code.localCount);
+
+			const std::vector<uint8_t>& bytecode = code.bytecode;
+			std::vector<bool> starts(bytecode.size());
+			for (size_t pc = 0; pc < bytecode.size();) {
+				require(bytecode[pc] < std::size(OperandKinds));
+				starts[pc] = true;
+				pc += 1 + operandSize(OperandKinds[bytecode[pc]]);
+				require(pc <= bytecode.size());
+			}
+
+			std::vector<std::optional<State>> states(bytecode.size());
+			std::vector<size_t> pending;
+			auto flow = [&](size_t pc, const State& state) {
+				require(pc < bytecode.size() && starts[pc]);
+				if (!states[pc]) {
+					states[pc] = state;
+					pending.push_back(pc);
+				}
+				else {
+					require(*states[pc] == state);
+				}
+			};
+			flow(0, State());
+
+			while (!pending.empty()) {
+				size_t pc = pending.back();
+				pending.pop_back();
+				State state = *states[pc];
+				Op op = static_cast<Op>(bytecode[pc]);
+				const uint8_t* operand = &bytecode[pc + 1];
+				auto pop = [&](uint32_t n) {
+					require(state.depth >= n);
+					state.depth -= n;
+				};
+				auto push = [&](uint32_t n) {
+					state.depth += n;
+					require(state.depth <= code.maxStack);
+				};
+				switch (op) {
+				case Op::Const:
+					require(constantAt(code, operand) != nullptr);
+					push(1);
+					break;
+				case Op::Nil:
+					push(1);
+					break;
+				case Op::LoadLocal:
+					slotAt(code, operand);
+					push(1);
+					break;
+				case Op::StoreLocal:
+					slotAt(code, operand);
+					require(state.depth >= 1);
+					break;
+				case Op::PopLocal:
+					slotAt(code, operand);
+					pop(1);
+					break;
+				case Op::LoadEnv:
+					addressAt(code, operand, state, outer);
+					push(1);
+					break;
+				case Op::StoreEnv:
+					addressAt(code, operand, state, outer);
+					require(state.depth >= 1);
+					break;
+				case Op::BindEnv:
+					slotAt(code, operand);
+					require(!state.frames.empty() && read16(operand + 2) < state.frames.back());
+					break;
+				case Op::LoadGlobal:
+					symbolAt(code, operand);
+					push(1);
+					break;
+				case Op::StoreGlobal:
+				case Op::Define:
+					symbolAt(code, operand);
+					require(state.depth >= 1);
+					break;
+				case Op::BindSpecial:
+					slotAt(code, operand);
+					symbolAt(code, operand + 2);
+					break;
+				case Op::PushEnv:
+					require(read32(operand) <= UINT16_MAX);
+					state.frames.push_back(static_cast<uint16_t>(read32(operand)));
+					break;
+				case Op::PopEnv:
+					require(!state.frames.empty());
+					state.frames.pop_back();
+					break;
+				case Op::PushDynamic:
+					++state.dynamic;
+					break;
+				case Op::PopDynamic:
+					require(state.dynamic > 0);
+					--state.dynamic;
+					break;
+				case Op::Pop:
+					pop(1);
+					break;
+				case Op::Jump:
+					flow(read32(operand), state);
+					continue;
+				case Op::JumpIfNull:
+					pop(1);
+					flow(read32(operand), state);
+					break;
+				case Op::Closure: {
+					const LObj& nested = constantAt(code, operand);
+					require(nested.typep<Code>());
+					verify(nested.getAs<Code>(), innerChain(state, outer));
+					push(1);
+					break;
+				}
+				case Op::Call:
+				case Op::TailCall:
+					require(read32(operand) < state.depth);
+					state.depth -= read32(operand);
+					break;
+				case Op::Return:
+					require(state.depth >= 1);
+					continue;
+				default: {
+					// Falling back to a call needs a slot for the function.
+					symbolAt(code, operand);
+					size_t argc = intrinsicArgc(op);
+					require(state.depth >= argc && state.depth + 1 <= code.maxStack);
+					state.depth = static_cast<uint32_t>(state.depth - argc + 1);
+					break;
+				}
+				}
+				flow(pc + 1 + operandSize(OperandKinds[bytecode[pc]]), state);
+			}
+		}
+
+	public:
+		void verify(const Code& code, const Chain& outer) {
+			if (verified.count({ &code, outer }))
+				return;
+			// Code is never nested in itself.
+			require(active.insert(&code).second);
+			verifyBody(code, outer);
+			active.erase(&code);
+			verified.insert({ &code, outer });
+		}
+
+		void verify(const Code* code, const Frame* env, size_t limit) {
+			require(code != nullptr);
+			Chain chain;
+			for (; env != nullptr; env = env->parent) {
+				require(chain.size() < limit);
+				chain.push_back(env->size);
+			}
+			verify(*code, chain);
+		}
+	};
+}
+
+Code* compile(Node* node) {
+	gc::DeferScope defer;
+	return Compiler(node).result();
+}
+
+void verifyLoaded(const std::vector<LObj>& objects) {
+	Verifier verifier;
+	for (const LObj& o : objects) {
+		if (o.typep<Code>() && o.getAs<Code>().isToplevel)
+			verifier.verify(&o.getAs<Code>(), nullptr, objects.size());
+		else if (o.typep<Proc>())
+			verifier.verify(o.getAs<Proc>().code, o.getAs<Proc>().env, objects.size());
+		else if (o.typep<Macro>())
+			verifier.verify(o.getAs<Macro>().code, o.getAs<Macro>().env, objects.size());
+	}
+}
+
+void Code::disassemble(std::ostream& os) const {
+	os << "params: " << parameterCount << (hasRest ? " + rest" : "")
+		<< ", locals: " << localCount << ", stack: " << maxStack << std::endl;
+	std::vector<const Code*> nested;
+	for (size_t pc = 0; pc < bytecode.size();) {
+		Op op = static_cast<Op>(bytecode[pc]);
+		os << "  " << pc << "\t" << OpNames[bytecode[pc]];
+		const uint8_t* operand = &bytecode[pc + 1];
+		switch (OperandKinds[bytecode[pc]]) {
+		case Operand::None:
+			pc += 1;
+			break;
+		case Operand::Index: {
+			const LObj& c = constants[read32(operand)];
+			os << "\t" << read32(operand) << "\t; " << c;
+			if (op == Op::Closure)
+				nested.push_back(&c.getAs<Code>());
+			pc += 5;
+			break;
+		}
+		case Operand::Slot:
+			os << "\t" << read16(operand) << "\t; " << slotNames[read16(operand)]->name;
+			pc += 3;
+			break;
+		case Operand::SlotIndex:
+			os << "\t" << read16(operand) << " " << read32(operand + 2) << "\t; " << constants[read32(operand + 2)];
+			pc += 7;
+			break;
+		case Operand::SlotField:
+			os << "\t" << read16(operand) << " " << read16(operand + 2) << "\t; " << slotNames[read16(operand)]->name;
+			pc += 5;
+			break;
+		case Operand::Address:
+			os << "\t" << read16(operand) << " " << read16(operand + 2) << "\t; " << constants[read32(operand + 4)];
+			pc += 9;
+			break;
+		case Operand::Target:
+			os << "\t" << read32(operand);
+			pc += 5;
+			break;
+		case Operand::Count:
+			os << "\t" << read32(operand);
+			pc += 5;
+			break;
+		}
+		os << std::endl;
+	}
+	for (const Code* c : nested) {
+		os << "; closure" << std::endl;
+		c->disassemble(os);
+	}
+}
+
+VM::VM(Profiler& p)
+	: stack(static_cast<LObj*>(std::calloc(StackSize, sizeof(LObj)))), sp(stack.get()), profiler(p) {
+	if (stack == nullptr)
+		throw std::bad_alloc();
+}
+
+void VM::trace() const {
+	for (const LObj* p = stack.get(); p < sp; ++p)
+		gc::mark(*p);
+	for (const CallFrame& frame : frames) {
+		gc::mark(frame.code);
+		gc::mark(frame.env);
+		gc::mark(frame.dynamicEnv);
+	}
+	gc::mark(dynamicEnv);
+}
+
+// Moves the arguments above `fnSlot` into the callee's parameter slots,
+// collecting a rest list and clearing the remaining locals, and pushes the
+// frame. Missing arguments leave their slots empty. A `tail` call has
+// already popped the caller's frame, which it replaces.
+void VM::pushFrame(Code* code, Frame* env, LObj* fnSlot, size_t argc, bool tail) {
+	LObj* args = fnSlot + 1;
+	if (args + code->localCount + code->maxStack > stack.get() + StackSize)
+		throw "Stack overflow";
+	size_t fixed = code->parameterCount;
+	bool hasRest = code->hasRest && argc >= fixed;
+	LObj rest;
+	if (hasRest) {
+		rest = LObj(&Symbols::Null);
+		for (size_t i = argc; i-- > fixed;)
+			rest = makeObj<Cons>(args[i], rest);
+	}
+	for (size_t i = std::min(argc, fixed); i < code->localCount; ++i)
+		args[i] = LObj();
+	if (hasRest)
+		args[fixed] = rest;
+	sp = args + code->localCount;
+	frames.push_back({ code, code->bytecode.data(), static_cast<size_t>(args - stack.get()), env, dynamicEnv });
+	if (frames.size() > peakDepth)
+		peakDepth = frames.size();
+	if constexpr (Profiling) {
+		if (profiler.isRunning()) {
+			if (tail)
+				profiler.replace(code);
+			else
+				profiler.enter(code);
+		}
+	}
+}
+
+void VM::callPrimitive(LObj* fnSlot) {
+	if (!fnSlot->typep<PredefinedProc>())
+		throw "Wrong usage";
+	PredefinedProc& proc = fnSlot->getAs<PredefinedProc>();
+	if constexpr (Profiling) {
+		if (profiler.isRunning()) profiler.enter(&proc);
+	}
+	LObj result = proc.call(*dynamicEnv, fnSlot + 1, sp - fnSlot - 1);
+	if constexpr (Profiling) {
+		if (profiler.isRunning()) profiler.leave();
+	}
+	sp = fnSlot;
+	*sp++ = result;
+}
+
+void VM::run(size_t entryDepth) {
+	const LObj null(&Symbols::Null);
+	CallFrame* frame;
+	const uint8_t* pc;
+	LObj* fp;
+	const LObj* constants;
+	Symbol* intrinsic;
+	uint16_t intrinsicArgc;
+
+#define VM_LOAD_FRAME() \
+	do { \
+		frame = &frames.back(); \
+		pc = frame->pc; \
+		fp = stack.get() + frame->base; \
+		constants = frame->code->constants.data(); \
+	} while (0)
+
+	// Leaves to a normal call of the builtin's current value unless the
+	// global has never been rebound.
+#define VM_INTRINSIC(argc) \
+	do { \
+		intrinsic = &constants[read32(pc)].getAs<Symbol>(); \
+		intrinsicArgc = argc; \
+		if (intrinsic->rebound || intrinsic->dynamic) \
+			goto intrinsicCall; \
+	} while (0)
+
+#ifdef VM_COMPUTED_GOTO
+	static void* const dispatchTable[] = {
+#define VM_LABEL(name, operand) &&op_##name,
+		VM_OPCODES(VM_LABEL)
+#undef VM_LABEL
+	};
+#define VM_CASE(name) op_##name
+#define VM_NEXT() goto *dispatchTable[*pc++]
+#else
+#define VM_CASE(name) case Op::name
+#define VM_NEXT() break
+#endif
+
+	VM_LOAD_FRAME();
+#ifdef VM_COMPUTED_GOTO
+	VM_NEXT();
+#else
+	for (;;) {
+		switch (static_cast<Op>(*pc++)) {
+#endif
+	VM_CASE(Const): {
+		*sp++ = constants[read32(pc)];
+		pc += 4;
+		VM_NEXT();
+	}
+	VM_CASE(Nil): {
+		*sp++ = null;
+		VM_NEXT();
+	}
+	VM_CASE(LoadLocal): {
+		uint16_t slot = read16(pc);
+		pc += 2;
+		if (fp[slot] == nullptr)
+			unresolvable(frame->code->slotNames[slot]);
+		*sp++ = fp[slot];
+		VM_NEXT();
+	}
+	VM_CASE(StoreLocal): {
+		fp[read16(pc)] = sp[-1];
+		pc += 2;
+		VM_NEXT();
+	}
+	VM_CASE(PopLocal): {
+		fp[read16(pc)] = *--sp;
+		pc += 2;
+		VM_NEXT();
+	}
+	VM_CASE(LoadEnv): {
+		Frame* env = frame->env;
+		for (uint16_t d = read16(pc); d > 0; --d)
+			env = env->parent;
+		LObj value = env->values()[read16(pc + 2)];
+		if (value == nullptr)
+			unresolvable(&constants[read32(pc + 4)].getAs<Symbol>());
+		*sp++ = value;
+		pc += 8;
+		VM_NEXT();
+	}
+	VM_CASE(StoreEnv): {
+		Frame* env = frame->env;
+		for (uint16_t d = read16(pc); d > 0; --d)
+			env = env->parent;
+		if (!gc::isLocal(env))
+			throw "Cannot change a captured variable inside a parallel task";
+		waitForTasks();
+		env->values()[read16(pc + 2)] = sp[-1];
+		pc += 8;
+		VM_NEXT();
+	}
+	VM_CASE(BindEnv): {
+		frame->env->values()[read16(pc + 2)] = fp[read16(pc)];
+		pc += 4;
+		VM_NEXT();
+	}
+	VM_CASE(LoadGlobal): {
+		Symbol* symbol = &constants[read32(pc)].getAs<Symbol>();
+		pc += 4;
+		LObj value = dynamicEnv->findSymbolInMap(symbol);
+		if (value == nullptr)
+			unresolvable(symbol);
+		*sp++ = value;
+		VM_NEXT();
+	}
+	VM_CASE(StoreGlobal): {
+		Symbol* symbol = &constants[read32(pc)].getAs<Symbol>();
+		pc += 4;
+		Env* target = dynamicEnv->findEnvironment(symbol);
+		if (target == nullptr) target = rootEnvironment();
+		target->bind(sp[-1], symbol);
+		VM_NEXT();
+	}
+	VM_CASE(Define): {
+		LObj symbol = constants[read32(pc)];
+		pc += 4;
+		Code* code = sp[-1].typep<Proc>() ? sp[-1].getAs<Proc>().code
+			: sp[-1].typep<Macro>() ? sp[-1].getAs<Macro>().code : nullptr;
+		rootEnvironment()->bind(sp[-1], &symbol.getAs<Symbol>());
+		if (code != nullptr && code->name == nullptr)
+			code->name = &symbol.getAs<Symbol>();
+		sp[-1] = symbol;
+		VM_NEXT();
+	}
+	VM_CASE(BindSpecial): {
+		LObj value = fp[read16(pc)];
+		if (value != nullptr)
+			dynamicEnv->bind(value, &constants[read32(pc + 2)].getAs<Symbol>());
+		pc += 6;
+		VM_NEXT();
+	}
+	VM_CASE(PushEnv): {
+		frame->env = Frame::create(frame->env, static_cast<uint16_t>(read32(pc)));
+		pc += 4;
+		VM_NEXT();
+	}
+	VM_CASE(PopEnv): {
+		frame->env = frame->env->parent;
+		VM_NEXT();
+	}
+	VM_CASE(PushDynamic): {
+		dynamicEnv = dynamicEnv->createSubEnvironment();
+		VM_NEXT();
+	}
+	VM_CASE(PopDynamic): {
+		dynamicEnv = dynamicEnv->getOutEnv();
+		VM_NEXT();
+	}
+	VM_CASE(Pop): {
+		--sp;
+		VM_NEXT();
+	}
+	VM_CASE(Jump): {
+		pc = frame->code->bytecode.data() + read32(pc);
+		VM_NEXT();
+	}
+	VM_CASE(JumpIfNull): {
+		if ((*--sp).isnull())
+			pc = frame->code->bytecode.data() + read32(pc);
+		else
+			pc += 4;
+		VM_NEXT();
+	}
+	VM_CASE(Closure): {
+		Code* code = &constants[read32(pc)].getAs<Code>();
+		pc += 4;
+		if (code->isMacro)
+			*sp++ = makeObj<Macro>(code, frame->env);
+		else
+			*sp++ = makeObj<Proc>(code, frame->env);
+		VM_NEXT();
+	}
+	VM_CASE(Call): {
+		uint32_t argc = read32(pc);
+		pc += 4;
+		LObj* fnSlot = sp - argc - 1;
+		LObj fn = *fnSlot;
+		frame->pc = pc;
+		if (fn.typep<Proc>()) {
+			Proc& proc = fn.getAs<Proc>();
+			pushFrame(proc.code, proc.env, fnSlot, argc);
+			VM_LOAD_FRAME();
+		}
+		else {
+			callPrimitive(fnSlot);
+			frame = &frames.back();
+		}
+		VM_NEXT();
+	}
+	VM_CASE(TailCall): {
+		uint32_t argc = read32(pc);
+		pc += 4;
+		LObj* fnSlot = sp - argc - 1;
+		if (!fnSlot->typep<Proc>()) {
+			frame->pc = pc;
+			callPrimitive(fnSlot);
+			frame = &frames.back();
+			VM_NEXT();
+		}
+		Proc& proc = fnSlot->getAs<Proc>();
+		// The callee still sees the special variables the caller bound, but
+		// they are folded into one Env, so a loop of tail calls that binds
+		// specials does not grow the chain.
+		Env* callerDynamicEnv = frame->dynamicEnv;
+		dynamicEnv = dynamicEnv->collapseInto(callerDynamicEnv);
+		LObj* target = fp - 1;
+		std::copy(fnSlot, sp, target);
+		sp = target + argc + 1;
+		frames.pop_back();
+		pushFrame(proc.code, proc.env, target, argc, true);
+		frames.back().dynamicEnv = callerDynamicEnv;
+		VM_LOAD_FRAME();
+		VM_NEXT();
+	}
+	VM_CASE(Return): {
+		LObj result = sp[-1];
+		sp = fp - 1;
+		dynamicEnv = frame->dynamicEnv;
+		if constexpr (Profiling) {
+			if (profiler.isRunning()) profiler.leave();
+		}
+		frames.pop_back();
+		*sp++ = result;
+		if (frames.size() == entryDepth)
+			return;
+		VM_LOAD_FRAME();
+		VM_NEXT();
+	}
+	VM_CASE(Add): {
+		VM_INTRINSIC(2);
+		intptr_t r;
+		if (sp[-2].isFixnum() && sp[-1].isFixnum() &&
+			!number::addOverflow(sp[-2].fixnumValue(), sp[-1].fixnumValue(), r))
+			sp[-2] = LObj::fixnum(r);
+		else if (isNumber(sp[-2]) && isNumber(sp[-1]))
+			sp[-2] = genericAdd(sp[-2], sp[-1]);
+		else
+			goto intrinsicCall;
+		--sp;
+		pc += 4;
+		VM_NEXT();
+	}
+	VM_CASE(Sub): {
+		VM_INTRINSIC(2);
+		intptr_t r;
+		if (sp[-2].isFixnum() && sp[-1].isFixnum() &&
+			!number::subOverflow(sp[-2].fixnumValue(), sp[-1].fixnumValue(), r))
+			sp[-2] = LObj::fixnum(r);
+		else if (isNumber(sp[-2]) && isNumber(sp[-1]))
+			sp[-2] = genericSub(sp[-2], sp[-1]);
+		else
+			goto intrinsicCall;
+		--sp;
+		pc += 4;
+		VM_NEXT();
+	}
+	VM_CASE(Mul): {
+		VM_INTRINSIC(2);
+		intptr_t r;
+		if (sp[-2].isFixnum() && sp[-1].isFixnum() &&
+			!number::mulOverflow(sp[-2].fixnumValue(), sp[-1].fixnumValue(), r))
+			sp[-2] = LObj::fixnum(r);
+		else if (isNumber(sp[-2]) && isNumber(sp[-1]))
+			sp[-2] = genericMul(sp[-2], sp[-1]);
+		else
+			goto intrinsicCall;
+		--sp;
+		pc += 4;
+		VM_NEXT();
+	}
+	VM_CASE(Less): {
+		VM_INTRINSIC(2);
+		bool less;
+		if (sp[-2].isFixnum() && sp[-1].isFixnum())
+			less = sp[-2].fixnumValue() < sp[-1].fixnumValue();
+		else if (isNumber(sp[-2]) && isNumber(sp[-1]))
+			less = genericCompare(sp[-2], sp[-1]) < 0;
+		else
+			goto intrinsicCall;
+		sp[-2] = less ? LObj(&Symbols::T) : null;
+		--sp;
+		pc += 4;
+		VM_NEXT();
+	}
+	VM_CASE(NumEq): {
+		VM_INTRINSIC(2);
+		bool same;
+		if (sp[-2].isFixnum() && sp[-1].isFixnum())
+			same = sp[-2] == sp[-1];
+		else if (isNumber(sp[-2]) && isNumber(sp[-1]))
+			same = genericCompare(sp[-2], sp[-1]) == 0;
+		else
+			goto intrinsicCall;
+		sp[-2] = same ? LObj(&Symbols::T) : null;
+		--sp;
+		pc += 4;
+		VM_NEXT();
+	}
+	VM_CASE(Car): {
+		VM_INTRINSIC(1);
+		if (!sp[-1].typep<Cons>())
+			goto intrinsicCall;
+		sp[-1] = sp[-1].getAs<Cons>().car;
+		pc += 4;
+		VM_NEXT();
+	}
+	VM_CASE(Cdr): {
+		VM_INTRINSIC(1);
+		if (!sp[-1].typep<Cons>())
+			goto intrinsicCall;
+		sp[-1] = sp[-1].getAs<Cons>().cdr;
+		pc += 4;
+		VM_NEXT();
+	}
+	VM_CASE(MakeCons): {
+		VM_INTRINSIC(2);
+		LObj cell = makeObj<Cons>(sp[-2], sp[-1]);
+		*--sp = LObj();
+		sp[-1] = cell;
+		pc += 4;
+		VM_NEXT();
+	}
+	VM_CASE(IsNull): {
+		VM_INTRINSIC(1);
+		sp[-1] = LObj(sp[-1].isnull() ? &Symbols::T : &Symbols::F);
+		pc += 4;
+		VM_NEXT();
+	}
+	intrinsicCall: {
+		pc += 4;
+		LObj* fnSlot = sp - intrinsicArgc;
+		std::copy_backward(fnSlot, sp, sp + 1);
+		++sp;
+		*fnSlot = dynamicEnv->findSymbolInMap(intrinsic);
+		if (*fnSlot == nullptr)
+			unresolvable(intrinsic);
+		frame->pc = pc;
+		if (fnSlot->typep<Proc>()) {
+			Proc& proc = fnSlot->getAs<Proc>();
+			pushFrame(proc.code, proc.env, fnSlot, intrinsicArgc);
+			VM_LOAD_FRAME();
+		}
+		else {
+			callPrimitive(fnSlot);
+			frame = &frames.back();
+		}
+		VM_NEXT();
+	}
+#ifndef VM_COMPUTED_GOTO
+		}
+	}
+#endif
+
+#undef VM_LOAD_FRAME
+#undef VM_INTRINSIC
+#undef VM_CASE
+#undef VM_NEXT
+}
+
+LObj VM::invoke(LObj fn, const std::vector<LObj>& args, Env* env, bool macro) {
+	LObj* savedSp = sp;
+	size_t depth = frames.size();
+	size_t profilerDepth = profiler.depth();
+	Env* savedDynamicEnv = dynamicEnv;
+	dynamicEnv = env;
+	try {
+		if (sp + args.size() + 1 > stack.get() + StackSize)
+			throw "Stack overflow";
+		LObj* fnSlot = sp;
+		*sp++ = fn;
+		for (const LObj& a : args)
+			*sp++ = a;
+		if (!macro && fn.typep<Proc>()) {
+			pushFrame(fn.getAs<Proc>().code, fn.getAs<Proc>().env, fnSlot, args.size());
+			run(depth);
+		}
+		else if (macro && fn.typep<Macro>()) {
+			pushFrame(fn.getAs<Macro>().code, fn.getAs<Macro>().env, fnSlot, args.size());
+			run(depth);
+		}
+		else if (!macro && fn.typep<Code>() && fn.getAs<Code>().isToplevel) {
+			pushFrame(&fn.getAs<Code>(), nullptr, fnSlot, 0);
+			run(depth);
+		}
+		else if (!macro && fn.typep<PredefinedProc>()) {
+			*fnSlot = fn.getAs<PredefinedProc>().call(*env, fnSlot + 1, args.size());
+		}
+		else {
+			throw "Wrong usage";
+		}
+	}
+	catch (...) {
+		sp = savedSp;
+		frames.resize(depth);
+		dynamicEnv = savedDynamicEnv;
+		if constexpr (Profiling) {
+			profiler.unwind(profilerDepth);
+		}
+		throw;
+	}
+	LObj result = *savedSp;
+	sp = savedSp;
+	dynamicEnv = savedDynamicEnv;
+	return result;
+}
+
+LObj VM::execute(Code* code, Env* env) {
+	return invoke(LObj(code), {}, env, false);
+}
+
+LObj VM::apply(LObj fn, const std::vector<LObj>& args, Env* env) {
+	return invoke(fn, args, env, false);
+}
+
+LObj VM::expand(Macro* macro, const std::vector<LObj>& args, Env* env) {
+	return invoke(LObj(macro), args, env, true);
+}
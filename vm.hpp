@@ -0,0 +1,178 @@
+#pragma once
+#include "lisp.hpp"
+#include "analyzer.hpp"
+#include <cstdlib>
+
+class Profiler;
+
+// Opcodes and the kind of operand each one takes. Operands follow the
+// opcode byte. Slots, frame depths and frame indexes are 16 bit; constant
+// indexes, argument counts and Targets, offsets into the bytecode, are 32
+// bit. An Address is (frame depth, index in frame, name constant).
+// The ops from Add on are open-coded calls to builtins; their operand is
+// the builtin's name, which is called normally once it has been rebound.
+#define VM_OPCODES(X) \
+	X(Const, Index) \
+	X(Nil, None) \
+	X(LoadLocal, Slot) \
+	X(StoreLocal, Slot) \
+	X(PopLocal, Slot) \
+	X(LoadEnv, Address) \
+	X(StoreEnv, Address) \
+	X(BindEnv, SlotField) \
+	X(LoadGlobal, Index) \
+	X(StoreGlobal, Index) \
+	X(Define, Index) \
+	X(BindSpecial, SlotIndex) \
+	X(PushEnv, Count) \
+	X(PopEnv, None) \
+	X(PushDynamic, None) \
+	X(PopDynamic, None) \
+	X(Pop, None) \
+	X(Jump, Target) \
+	X(JumpIfNull, Target) \
+	X(Closure, Index) \
+	X(Call, Count) \
+	X(TailCall, Count) \
+	X(Return, None) \
+	X(Add, Index) \
+	X(Sub, Index) \
+	X(Mul, Index) \
+	X(Less, Index) \
+	X(NumEq, Index) \
+	X(Car, Index) \
+	X(Cdr, Index) \
+	X(MakeCons, Index) \
+	X(IsNull, Index)
+
+enum class Op : uint8_t {
+#define VM_ENUM(name, operand) name,
+	VM_OPCODES(VM_ENUM)
+#undef VM_ENUM
+};
+
+class Code : public Base_Object {
+public:
+	static constexpr Type TypeTag = Type::Code;
+	std::vector<uint8_t> bytecode;
+	std::vector<LObj> constants;
+	std::vector<Symbol*> slotNames;
+	uint16_t parameterCount = 0;
+	uint16_t localCount = 0;
+	uint32_t maxStack = 0;
+	bool hasRest = false;
+	bool isMacro = false;
+	bool isToplevel = false;
+	// The symbol this was first defined as, for profiles.
+	Symbol* name = nullptr;
+
+	Code()
+		: Base_Object(TypeTag) {}
+
+	void trace() const override {
+		for (const LObj& c : constants) gc::mark(c);
+		for (Symbol* s : slotNames) gc::mark(s);
+		gc::mark(name);
+	}
+
+	std::ostream& operator<<(std::ostream& os) const override {
+		os << "<Code>";
+		return os;
+	}
+
+	void disassemble(std::ostream& os) const;
+};
+
+// The variables of one scope that inner lambdas capture, addressed by
+// index. The values are stored inline after the object.
+class Frame : public Base_Object {
+public:
+	static constexpr Type TypeTag = Type::Frame;
+	Frame* parent;
+	const uint16_t size;
+
+	Frame(Frame* p, uint16_t n)
+		: Base_Object(TypeTag), parent(p), size(n) {}
+
+	static Frame* create(Frame* parent, uint16_t size) {
+		void* cell = gc::allocate(sizeof(Frame) + size * sizeof(LObj), TypeTag);
+		Frame* frame = new (cell) Frame(parent, size);
+		std::uninitialized_default_construct_n(frame->values(), size);
+		return frame;
+	}
+
+	LObj* values() {
+		return reinterpret_cast<LObj*>(this + 1);
+	}
+	const LObj* values() const {
+		return reinterpret_cast<const LObj*>(this + 1);
+	}
+
+	void trace() const override {
+		gc::mark(parent);
+		for (uint16_t i = 0; i < size; ++i)
+			gc::mark(values()[i]);
+	}
+
+	std::ostream& operator<<(std::ostream& os) const override {
+		os << "<Frame>";
+		return os;
+	}
+};
+
+struct CallFrame {
+	Code* code;
+	const uint8_t* pc;
+	size_t base;
+	Frame* env;
+	Env* dynamicEnv;
+};
+
+// Stack machine that runs compiled Code. Arguments and local variables live
+// in stack slots above the callee; Lisp-to-Lisp calls push a CallFrame
+// instead of recursing on the C++ stack.
+class VM {
+private:
+	static constexpr size_t StackSize = 1 << 20;
+
+	struct FreeStack {
+		void operator()(LObj* p) const {
+			std::free(p);
+		}
+	};
+
+	// Zero-filled by calloc, so its pages are only touched as the stack
+	// grows and an idle interpreter stays cheap.
+	std::unique_ptr<LObj[], FreeStack> stack;
+	LObj* sp;
+	std::vector<CallFrame> frames;
+	size_t peakDepth = 0;
+	Env* dynamicEnv = nullptr;
+	Profiler& profiler;
+
+	void pushFrame(Code* code, Frame* env, LObj* fnSlot, size_t argc, bool tail = false);
+	void callPrimitive(LObj* fnSlot);
+	void run(size_t entryDepth);
+	LObj invoke(LObj fn, const std::vector<LObj>& args, Env* env, bool macro);
+
+public:
+	explicit VM(Profiler& p);
+
+	LObj execute(Code* code, Env* env);
+	LObj apply(LObj fn, const std::vector<LObj>& args, Env* env);
+	LObj expand(Macro* macro, const std::vector<LObj>& args, Env* env);
+
+	// Deepest nesting of Lisp calls seen so far.
+	size_t peakCallDepth() const {
+		return peakDepth;
+	}
+
+	void trace() const;
+};
+
+Code* compile(Node* node);
+
+// Throws unless the VM can safely run every top-level Code, Proc and Macro
+// among `objects`, as read from an image or compiled file. Other Code is
+// checked where a Closure op of checked Code creates it.
+void verifyLoaded(const std::vector<LObj>& objects);